@@ -0,0 +1,106 @@
+// Accuracy check of the AGS synthesis engine's spectral renderer.
+
+// Renders saturated sine clouds once in the time domain and once with
+// inverse-FFT overlap-add, for a range of grain durations and both
+// envelopes, and reports the relative RMS error of the spectral output.
+// The exit status is non-zero when an error goes over the -35 dB the
+// spectral renderer is documented to stay within.
+
+// Usage: ags_check [--seconds s] [--tolerance dB]
+
+// Copyright (C) 2018 Sihwa Park
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "ags_engine.h"
+
+#include <cstdlib>
+
+using namespace std;
+
+// renders seconds of a saturated sine day, spectralThreshold 0 being the
+// time domain
+vector<float> render(float sampleRate, float grainDuration, int envelopeType, unsigned spectralThreshold, float seconds) {
+  const unsigned blockSize = 512;
+
+  ags::Engine engine;
+  engine.useBlockCache = false;
+  engine.spectralThreshold = spectralThreshold;
+  engine.grainEnvType = envelopeType;
+  engine.setup(sampleRate, blockSize);
+  engine.setCloudDuration(500.0f);
+  engine.grainDuration = grainDuration;
+
+  unsigned bandCount = engine.bandCount;
+  vector<vector<float>> data(2, vector<float>(bandCount, 1440.0f / bandCount));
+  engine.load(data);
+
+  unsigned blocks = max(1u, (unsigned)(seconds * sampleRate / blockSize));
+  vector<float> out(blocks * blockSize);
+  for(unsigned b = 0; b < blocks; b++)
+    engine.render(&out[b * blockSize], blockSize);
+
+  return out;
+}
+
+int main(int argc, char* argv[]) {
+  float seconds = 1.0f;
+  float tolerance = -35.0f;
+
+  for(int i = 1; i < argc; i++) {
+    if(strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) seconds = atof(argv[++i]);
+    else if(strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) tolerance = atof(argv[++i]);
+    else {
+      fprintf(stderr, "usage: %s [--seconds s] [--tolerance dB]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  const float sampleRates[] = { 44100.0f, 96000.0f };
+  const float grainDurations[] = { 10.0f, 25.0f, 50.0f, 200.0f, 500.0f };
+  const char* envelopes[] = { "linear", "hann" };
+
+  printf("%8s %9s %9s %9s\n", "rate", "grain ms", "envelope", "error dB");
+
+  int violations = 0;
+  for(float sampleRate : sampleRates) {
+    for(float grainDuration : grainDurations) {
+      for(int envelope = 0; envelope < 2; envelope++) {
+        vector<float> reference = render(sampleRate, grainDuration, envelope, 0, seconds);
+        vector<float> spectral = render(sampleRate, grainDuration, envelope, 1, seconds);
+
+        double signal = 0, error = 0;
+        for(size_t k = 0; k < reference.size(); k++) {
+          double d = spectral[k] - reference[k];
+          signal += (double)reference[k] * reference[k];
+          error += d * d;
+        }
+
+        float db = 10 * log10((error + 1e-30) / (signal + 1e-30));
+        bool over = (db > tolerance);
+
+        printf("%8.0f %9.0f %9s %9.1f%s\n", sampleRate, grainDuration, envelopes[envelope], db,
+          over ? "  over tolerance" : "");
+        if(over) violations++;
+      }
+    }
+  }
+
+  if(violations > 0) {
+    printf("%d configurations over tolerance (%.0f dB)\n", violations, tolerance);
+    return 1;
+  }
+
+  return 0;
+}
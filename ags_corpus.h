@@ -0,0 +1,374 @@
+// Memory-mapped sound corpus for sample-based grains.
+
+// Indexing a corpus only parses WAV headers and maps the files read-only,
+// so a corpus of any size opens at once and only the pages that grains
+// actually read take up memory, shared between all grains and with the
+// page cache. 16-bit and 32-bit float PCM at the engine rate are read in
+// place. Anything else is converted once, at indexing time, into a mono
+// float copy at the engine rate next to the source (<file>.<rate>.f32),
+// which later runs map directly as long as it is newer than the source.
+
+// Copyright (C) 2018 Sihwa Park
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef AGS_CORPUS_H
+#define AGS_CORPUS_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace ags {
+
+using std::max;
+using std::min;
+using std::sort;
+using std::string;
+using std::upper_bound;
+using std::vector;
+
+// One sound of the corpus as it lies in a mapping: interleaved frames of
+// 16-bit or float samples, averaged to mono when read.
+struct CorpusSound {
+  const unsigned char* data = nullptr;
+  unsigned frameCount = 0;
+  unsigned channels = 1;
+  bool isFloat = false;
+
+  float frame(unsigned i) const {
+    const unsigned char* p = data + (size_t)i * channels * (isFloat ? 4 : 2);
+    float sum = 0;
+
+    for(unsigned c = 0; c < channels; c++) {
+      if(isFloat) {
+        float v;
+        memcpy(&v, p + c * 4, 4);
+        sum += v;
+      } else {
+        int16_t v;
+        memcpy(&v, p + c * 2, 2);
+        sum += v * (1.0f / 32768.0f);
+      }
+    }
+    return (channels == 1) ? sum : sum / channels;
+  }
+
+  // linear interpolation between the frames around a fractional position,
+  // which must be below frameCount - 1
+  float at(double position) const {
+    unsigned i = (unsigned)position;
+    float frac = (float)(position - i);
+    float a = frame(i);
+    return a + frac * (frame(i + 1) - a);
+  }
+};
+
+struct SampleCorpus {
+  float sampleRate = 44100.0f;
+
+  // grains play back at frequency / rootFrequency times the recorded
+  // speed, so a grain at the root pitch plays its window untransposed
+  float rootMidi = 96.0f;
+
+  vector<CorpusSound> sounds;
+  vector<uint64_t> offsets; // first frame of each sound in the whole corpus
+  uint64_t totalFrames = 0;
+
+  // bumped on every index(), so that clouds and cached blocks made from an
+  // earlier corpus can tell
+  unsigned generation = 0;
+
+  struct Mapping {
+    void* address;
+    size_t length;
+  };
+  vector<Mapping> mappings;
+
+  SampleCorpus() {}
+  SampleCorpus(const SampleCorpus&) = delete;
+  SampleCorpus& operator=(const SampleCorpus&) = delete;
+
+  ~SampleCorpus() { clear(); }
+
+  float rootFrequency() const { return 440.0f * powf(2.0f, (rootMidi - 69.0f) / 12.0f); }
+
+  void clear() {
+    for(auto& m : mappings) munmap(m.address, m.length);
+    mappings.clear();
+    sounds.clear();
+    offsets.clear();
+    totalFrames = 0;
+  }
+
+  // indexes a WAV file, or every WAV file of a directory in name order.
+  // Must not run while grains are reading the corpus.
+  bool index(const char* path, float rate) {
+    clear();
+    sampleRate = rate;
+    generation++;
+
+    vector<string> files;
+    struct stat st;
+    if(stat(path, &st) != 0) return false;
+
+    if(S_ISDIR(st.st_mode)) {
+      DIR* dir = opendir(path);
+      if(dir == nullptr) return false;
+
+      while(dirent* entry = readdir(dir)) {
+        string name = entry->d_name;
+        string extension = (name.size() > 4) ? name.substr(name.size() - 4) : "";
+        if(extension == ".wav" || extension == ".WAV") files.push_back(string(path) + "/" + name);
+      }
+      closedir(dir);
+      sort(files.begin(), files.end());
+    } else {
+      files.push_back(path);
+    }
+
+    for(auto& file : files) {
+      CorpusSound sound;
+      if(add(file, sound) == false) {
+        fprintf(stderr, "Error: can't read %s into the corpus!\n", file.c_str());
+        continue;
+      }
+
+      offsets.push_back(totalFrames);
+      sounds.push_back(sound);
+      totalFrames += sound.frameCount;
+    }
+
+    return sounds.empty() == false;
+  }
+
+  // picks the sound and first frame of a window of length frames at ratio
+  // (0 to 1) of the whole corpus, or nullptr when no sound is long enough
+  const CorpusSound* locate(float ratio, unsigned length, unsigned& start) const {
+    if(sounds.empty()) return nullptr;
+
+    uint64_t target = (uint64_t)(ratio * totalFrames);
+    unsigned i = upper_bound(offsets.begin(), offsets.end(), target) - offsets.begin() - 1;
+
+    const CorpusSound& sound = sounds[i];
+    if(sound.frameCount < length + 1) return nullptr;
+
+    start = (unsigned)min<uint64_t>(target - offsets[i], sound.frameCount - length - 1);
+    return &sound;
+  }
+
+ private:
+  struct WavInfo {
+    unsigned format = 0; // 1 integer PCM, 3 float
+    unsigned channels = 0;
+    unsigned rate = 0;
+    unsigned bits = 0;
+    size_t dataOffset = 0;
+    size_t dataBytes = 0;
+  };
+
+  const unsigned char* map(const string& path, size_t& length) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) return nullptr;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0) {
+      ::close(fd);
+      return nullptr;
+    }
+
+    length = st.st_size;
+    void* p = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(p == MAP_FAILED) return nullptr;
+
+    mappings.push_back({ p, length });
+    return (const unsigned char*)p;
+  }
+
+  static unsigned le(const unsigned char* p, unsigned bytes) {
+    unsigned v = 0;
+    for(unsigned i = 0; i < bytes; i++) v |= (unsigned)p[i] << (8 * i);
+    return v;
+  }
+
+  static bool parse(const unsigned char* p, size_t length, WavInfo& info) {
+    if(length < 12 || memcmp(p, "RIFF", 4) != 0 || memcmp(p + 8, "WAVE", 4) != 0) return false;
+
+    size_t pos = 12;
+    while(pos + 8 <= length) {
+      size_t size = le(p + pos + 4, 4);
+      const unsigned char* body = p + pos + 8;
+
+      if(memcmp(p + pos, "fmt ", 4) == 0 && size >= 16 && pos + 8 + size <= length) {
+        info.format = le(body, 2);
+        info.channels = le(body + 2, 2);
+        info.rate = le(body + 4, 4);
+        info.bits = le(body + 14, 2);
+
+        // WAVE_FORMAT_EXTENSIBLE keeps the actual format in its sub-format
+        if(info.format == 0xFFFE && size >= 26) info.format = le(body + 24, 2);
+      } else if(memcmp(p + pos, "data", 4) == 0) {
+        info.dataOffset = pos + 8;
+        info.dataBytes = min(size, length - info.dataOffset);
+        break;
+      }
+
+      pos += 8 + size + (size & 1);
+    }
+
+    return info.dataOffset > 0 && info.channels > 0 && info.rate > 0
+      && (info.format == 1 || info.format == 3) && info.bits % 8 == 0 && info.bits > 0;
+  }
+
+  // integer or float sample c of frame i as a float
+  static float sampleOf(const unsigned char* data, const WavInfo& info, size_t i, unsigned c) {
+    unsigned bytes = info.bits / 8;
+    const unsigned char* p = data + (i * info.channels + c) * bytes;
+
+    if(info.format == 3) {
+      if(bytes == 8) {
+        double v;
+        memcpy(&v, p, 8);
+        return (float)v;
+      }
+      float v;
+      memcpy(&v, p, 4);
+      return v;
+    }
+
+    if(bytes == 1) return (p[0] - 128) / 128.0f;
+
+    // the top bytes of a little-endian integer sample, sign extended
+    int32_t v = 0;
+    for(unsigned k = 0; k < min(bytes, 4u); k++) v |= (int32_t)p[bytes - 1 - k] << (24 - 8 * k);
+    return v / 2147483648.0f;
+  }
+
+  bool add(const string& path, CorpusSound& sound) {
+    size_t length;
+    const unsigned char* p = map(path, length);
+    if(p == nullptr) return false;
+
+    // the source mapping is dropped unless frames are read from it in place
+    auto unmapSource = [&] {
+      munmap(mappings.back().address, mappings.back().length);
+      mappings.pop_back();
+    };
+
+    WavInfo info;
+    if(parse(p, length, info) == false) {
+      unmapSource();
+      return false;
+    }
+
+    const unsigned char* data = p + info.dataOffset;
+    size_t frames = info.dataBytes / (info.channels * (info.bits / 8));
+
+    bool direct = (info.rate == (unsigned)sampleRate)
+      && ((info.format == 1 && info.bits == 16) || (info.format == 3 && info.bits == 32));
+
+    if(direct) {
+      sound.data = data;
+      sound.frameCount = frames;
+      sound.channels = info.channels;
+      sound.isFloat = (info.format == 3);
+      return true;
+    }
+
+    string copyPath = path + "." + std::to_string((unsigned)sampleRate) + ".f32";
+    size_t copyFrames = (size_t)ceil(frames * (double)sampleRate / info.rate);
+
+    struct stat source, copy;
+    bool fresh = stat(path.c_str(), &source) == 0 && stat(copyPath.c_str(), &copy) == 0
+      && copy.st_mtime >= source.st_mtime && (size_t)copy.st_size == copyFrames * sizeof(float);
+
+    bool converted = fresh || convert(data, frames, info, copyPath, copyFrames);
+    unmapSource();
+    if(converted == false) return false;
+
+    const unsigned char* c = map(copyPath, length);
+    if(c == nullptr) return false;
+
+    sound.data = c;
+    sound.frameCount = length / sizeof(float);
+    sound.channels = 1;
+    sound.isFloat = true;
+    return true;
+  }
+
+  // writes a mono float copy at the corpus rate, resampled with a
+  // Blackman-windowed sinc whose cutoff follows the lower of both rates
+  bool convert(const unsigned char* data, size_t frames, const WavInfo& info, const string& path, size_t copyFrames) {
+    FILE* file = fopen(path.c_str(), "wb");
+    if(file == nullptr) return false;
+
+    const int radius = 16;
+    double step = info.rate / (double)sampleRate;
+    double cutoff = min(1.0, 1.0 / step);
+
+    auto mono = [&](size_t i) {
+      float sum = 0;
+      for(unsigned c = 0; c < info.channels; c++) sum += sampleOf(data, info, i, c);
+      return sum / info.channels;
+    };
+
+    vector<float> block;
+    block.reserve(4096);
+
+    for(size_t j = 0; j < copyFrames; j++) {
+      float v;
+
+      if(info.rate == (unsigned)sampleRate) {
+        v = mono(j);
+      } else {
+        double center = j * step;
+        long first = (long)floor(center - radius / cutoff) + 1;
+        long last = (long)floor(center + radius / cutoff);
+        double sum = 0, weight = 0;
+
+        for(long i = max(first, 0L); i <= last && i < (long)frames; i++) {
+          double x = (i - center) * cutoff;
+          double sinc = (x == 0) ? 1.0 : sin(M_PI * x) / (M_PI * x);
+          double w = 0.42 + 0.5 * cos(M_PI * x / radius) + 0.08 * cos(2 * M_PI * x / radius);
+          sum += mono(i) * sinc * w;
+          weight += sinc * w;
+        }
+        v = (weight != 0) ? (float)(sum / weight) : 0;
+      }
+
+      block.push_back(v);
+      if(block.size() == block.capacity()) {
+        fwrite(block.data(), sizeof(float), block.size(), file);
+        block.clear();
+      }
+    }
+
+    fwrite(block.data(), sizeof(float), block.size(), file);
+    return fclose(file) == 0;
+  }
+};
+
+} // namespace ags
+
+#endif
@@ -0,0 +1,208 @@
+// C interface of the headless AGS synthesis engine, see ags_engine_c.h.
+
+// Copyright (C) 2018 Sihwa Park
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "ags_engine_c.h"
+#include "ags_engine.h"
+
+#include <exception>
+#include <new>
+
+struct ags_engine {
+  ags::Engine engine;
+};
+
+// exceptions must not cross the C boundary
+template <typename F>
+static int guarded(F f) {
+  try {
+    return f() ? 0 : -1;
+  } catch(const std::exception&) {
+    return -1;
+  }
+}
+
+ags_engine* ags_engine_create(float sample_rate, unsigned max_block_size) {
+  if(sample_rate <= 0 || max_block_size == 0) return nullptr;
+
+  ags_engine* e = new (std::nothrow) ags_engine;
+  if(e == nullptr) return nullptr;
+
+  if(guarded([&] { e->engine.setup(sample_rate, max_block_size); return true; }) != 0) {
+    delete e;
+    return nullptr;
+  }
+
+  return e;
+}
+
+void ags_engine_destroy(ags_engine* engine) {
+  delete engine;
+}
+
+int ags_engine_load_file(ags_engine* engine, const char* path) {
+  return guarded([&] { return engine->engine.load(path); });
+}
+
+static std::vector<std::vector<float>> rowsOf(const float* values, unsigned days, unsigned bands) {
+  std::vector<std::vector<float>> data(days);
+  for(unsigned i = 0; i < days; i++)
+    data[i].assign(values + i * bands, values + (i + 1) * bands);
+  return data;
+}
+
+int ags_engine_load_data(ags_engine* engine, const float* values, unsigned days, unsigned bands) {
+  if(bands == 0) return -1;
+
+  return guarded([&] {
+    return engine->engine.load(rowsOf(values, days, bands));
+  });
+}
+
+int ags_engine_add_file(ags_engine* engine, const char* path, float gain, int band_offset) {
+  return guarded([&] { return engine->engine.addDataset(path, gain, band_offset); });
+}
+
+int ags_engine_add_data(ags_engine* engine, const float* values, unsigned days, unsigned bands,
+                        float gain, int band_offset) {
+  if(bands == 0) return -1;
+
+  return guarded([&] {
+    return engine->engine.addDataset(rowsOf(values, days, bands), gain, band_offset);
+  });
+}
+
+int ags_engine_set_dataset_gain(ags_engine* engine, unsigned dataset, float gain) {
+  if(dataset >= engine->engine.datasets.size()) return -1;
+
+  engine->engine.datasets[dataset].gain = gain;
+  return 0;
+}
+
+unsigned ags_engine_dataset_count(const ags_engine* engine) {
+  return engine->engine.datasets.size();
+}
+
+int ags_engine_load_corpus(ags_engine* engine, const char* path) {
+  return guarded([&] { return engine->engine.loadCorpus(path); });
+}
+
+int ags_engine_load_preset(ags_engine* engine, const char* path) {
+  return guarded([&] { return engine->engine.loadPreset(path); });
+}
+
+int ags_engine_save_preset(const ags_engine* engine, const char* path) {
+  return guarded([&] { return engine->engine.savePreset(path); });
+}
+
+void ags_engine_set_seed(ags_engine* engine, unsigned seed) {
+  engine->engine.randomSeed = seed;
+}
+
+int ags_engine_set_cloud_duration(ags_engine* engine, float milliseconds) {
+  if(!(milliseconds >= 100.0f && milliseconds <= 500.0f)) return -1;
+
+  engine->engine.setCloudDuration(milliseconds);
+  return 0;
+}
+
+int ags_engine_set_grain_duration(ags_engine* engine, float milliseconds) {
+  if(!(milliseconds >= 10.0f && milliseconds <= 50.0f)) return -1;
+
+  engine->engine.grainDuration = milliseconds;
+  return 0;
+}
+
+int ags_engine_set_band(ags_engine* engine, unsigned band, float midi_low, float midi_high) {
+  if(band >= engine->engine.bandCount || midi_low >= midi_high) return -1;
+
+  engine->engine.bands[band].minMidi = midi_low;
+  engine->engine.bands[band].maxMidi = midi_high;
+  return 0;
+}
+
+int ags_engine_set_mute(ags_engine* engine, unsigned band, int mute) {
+  if(band >= engine->engine.bandCount) return -1;
+
+  engine->engine.bands[band].mute = (mute != 0);
+  return 0;
+}
+
+int ags_engine_set_waveform(ags_engine* engine, int waveform) {
+  if(waveform < AGS_WAVEFORM_SINE || waveform > AGS_WAVEFORM_SAMPLE) return -1;
+
+  engine->engine.grainWaveFormType = waveform;
+  return 0;
+}
+
+int ags_engine_set_envelope(ags_engine* engine, int envelope) {
+  if(envelope < AGS_ENVELOPE_ATTACK_DECAY || envelope > AGS_ENVELOPE_HANN) return -1;
+
+  engine->engine.grainEnvType = envelope;
+  return 0;
+}
+
+void ags_engine_set_block_cache(ags_engine* engine, int enabled) {
+  engine->engine.useBlockCache = (enabled != 0);
+}
+
+void ags_engine_set_active_band_gain(ags_engine* engine, int enabled) {
+  engine->engine.normalizeByActiveBands = (enabled != 0);
+}
+
+void ags_engine_set_grain_cache(ags_engine* engine, int enabled, float cents) {
+  engine->engine.useGrainCache = (enabled != 0);
+  if(cents > 0) engine->engine.grainCacheCents = cents;
+}
+
+void ags_engine_set_spectral_threshold(ags_engine* engine, unsigned grains) {
+  engine->engine.spectralThreshold = grains;
+}
+
+int ags_engine_set_render_threads(ags_engine* engine, unsigned threads) {
+  return guarded([&] { engine->engine.setRenderThreads(threads); return true; });
+}
+
+int ags_engine_set_day(ags_engine* engine, unsigned day) {
+  if(day >= engine->engine.days) return -1;
+
+  engine->engine.seek(day);
+  return 0;
+}
+
+unsigned ags_engine_day(const ags_engine* engine) {
+  return engine->engine.elapsedDay;
+}
+
+unsigned ags_engine_band_count(const ags_engine* engine) {
+  return engine->engine.bandCount;
+}
+
+unsigned ags_engine_days(const ags_engine* engine) {
+  return engine->engine.days;
+}
+
+void ags_engine_render(ags_engine* engine, float* out, unsigned frames) {
+  engine->engine.render(out, frames);
+}
+
+int ags_trace_start(const char* path) {
+  return guarded([&] { return ags::tracer().start(path); });
+}
+
+void ags_trace_stop(void) {
+  ags::tracer().stop();
+}
@@ -0,0 +1,2872 @@
+// Headless synthesis engine of the AGS sonification interface.
+
+// The engine turns hourly use durations into clouds of grains and renders
+// them into a caller buffer. It has no dependency on AudioPlatform, windowing
+// or audio devices, so it can be linked into batch jobs through the C API in
+// ags_engine_c.h or included directly, as ags_sonfication.cpp does.
+
+// Copyright (C) 2018 Sihwa Park
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef AGS_ENGINE_H
+#define AGS_ENGINE_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <complex>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "ags_corpus.h"
+#include "ags_trace.h"
+
+// attributes of the grain kernels, see renderGrain(). GCC only vectorizes
+// loops of unknown length from -O3 on, unless told to for the function.
+// ThreadSanitizer crashes in the run-time dispatch, so it gets no clones.
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__) \
+  && !defined(__SANITIZE_THREAD__)
+#define AGS_KERNEL __attribute__((target_clones("avx2", "default"), optimize("vect-cost-model=dynamic")))
+#elif defined(__GNUC__) && !defined(__clang__)
+#define AGS_KERNEL __attribute__((optimize("vect-cost-model=dynamic")))
+#else
+#define AGS_KERNEL
+#endif
+
+namespace ags {
+
+using std::all_of;
+using std::array;
+using std::atomic;
+using std::back_inserter;
+using std::complex;
+using std::endl;
+using std::fill;
+using std::ifstream;
+using std::integer_sequence;
+using std::make_integer_sequence;
+using std::max;
+using std::min;
+using std::mt19937;
+using std::ofstream;
+using std::sort;
+using std::string;
+using std::stringstream;
+using std::uniform_real_distribution;
+using std::unique_ptr;
+using std::unordered_map;
+using std::vector;
+
+template <typename Out>
+void split(const string& s, char delim, Out result) {
+  stringstream ss(s);
+  string item;
+  while(getline(ss, item, delim)) {
+    *(result++) = item;
+  }
+}
+
+inline vector<string> split(const string& s, char delim) {
+  vector<string> elems;
+  split(s, delim, back_inserter(elems));
+  return elems;
+}
+
+inline float mtof(float m) { return 8.175799f * powf(2.0f, m / 12.0f); }
+inline float ftom(float f) { return 12.0f * log2f(f / 8.175799f); }
+
+// one period of a waveform, read with linear interpolation. The size is a
+// power of two so that indices wrap with a mask rather than a divide, which
+// lets the grain kernels vectorize.
+struct Table {
+  vector<float> data;
+  unsigned size = 0;
+  int mask = 0; // size - 1
+
+  // index must not be negative
+  float get(float index) const {
+    int k = (int)index;
+    int i = k & mask;
+    int j = (k + 1) & mask;
+    float t = index - k;
+    return data[i] + t * (data[j] - data[i]);
+  }
+};
+
+// the sine table and the hann window are shared by every grain
+inline const Table& sineTable() {
+  static const Table table = [] {
+    Table t;
+    t.size = 4096;
+    t.mask = t.size - 1;
+    t.data.resize(t.size);
+    for(unsigned i = 0; i < t.size; i++) t.data[i] = sinf(2 * M_PI * i / t.size);
+    return t;
+  }();
+  return table;
+}
+
+inline const Table& hannWindow() {
+  static const Table table = [] {
+    Table t;
+    t.size = 4096;
+    t.mask = t.size - 1;
+    t.data.resize(t.size);
+    for(unsigned i = 0; i < t.size; i++) t.data[i] = 0.5f - 0.5f * cosf(2 * M_PI * i / t.size);
+    return t;
+  }();
+  return table;
+}
+
+// in-place radix-2 complex FFT
+struct FFT {
+  unsigned size = 0;
+  vector<complex<float>> twiddles; // e^(i 2 pi k / size) for k < size / 2
+  vector<unsigned> bitReverse;
+
+  void setup(unsigned n) {
+    size = n;
+
+    twiddles.resize(n / 2);
+    for(unsigned k = 0; k < n / 2; k++)
+      twiddles[k] = std::polar(1.0, 2 * M_PI * k / n);
+
+    unsigned bits = 0;
+    while((1u << bits) < n) bits++;
+
+    bitReverse.resize(n);
+    for(unsigned i = 0; i < n; i++) {
+      unsigned r = 0;
+      for(unsigned b = 0; b < bits; b++) r |= ((i >> b) & 1) << (bits - 1 - b);
+      bitReverse[i] = r;
+    }
+  }
+
+  // unnormalized inverse transform
+  void inverse(complex<float>* x) const {
+    for(unsigned i = 0; i < size; i++) {
+      unsigned j = bitReverse[i];
+      if(i < j) std::swap(x[i], x[j]);
+    }
+
+    float* v = reinterpret_cast<float*>(x);
+    for(unsigned length = 2; length <= size; length <<= 1) {
+      unsigned half = length / 2;
+      unsigned stride = size / length;
+
+      for(unsigned i = 0; i < size; i += length) {
+        for(unsigned k = 0; k < half; k++) {
+          float wr = twiddles[k * stride].real(), wi = twiddles[k * stride].imag();
+          float* a = v + 2 * (i + k);
+          float* b = v + 2 * (i + k + half);
+          float tr = wr * b[0] - wi * b[1];
+          float ti = wr * b[1] + wi * b[0];
+          b[0] = a[0] - tr;
+          b[1] = a[1] - ti;
+          a[0] += tr;
+          a[1] += ti;
+        }
+      }
+    }
+  }
+};
+
+struct Grain;
+
+// renders up to n samples of a grain, added to out, and returns how many
+// it rendered before the grain ended
+typedef unsigned (*GrainKernel)(Grain& g, float* out, unsigned n);
+
+inline GrainKernel grainKernel(int waveFormType, int envelopeType, bool hasSource);
+
+struct Grain {
+
+  float grainDuration; // milliseconds
+  unsigned grainDurationInSamples; // milliseconds
+  float frequency;
+  float frequnecyRatio;
+  float minFrequency, maxFrequency;
+
+  float sampleRate;
+  float startTimeRatio;
+  
+  int waveFormType = 0;
+  int envlopeType = 1;
+  unsigned currentPosInSamples = 0;
+
+  // waveforms and envelopes are functions of the position in the grain,
+  // computed from these when the frequency or duration changes
+  float increment = 0;     // oscillator phase per sample
+  uint32_t phaseIncrement = 0; // its fraction in 32-bit fixed point
+  unsigned attackLength = 0; // samples until the linear envelope peaks
+  float rampIncrement = 1; // linear envelope change per sample
+  float hannStep = 0;      // hann window phase per sample, see GrainEnvelope<1>
+
+  // picked from the waveform and envelope, see grainKernel()
+  GrainKernel kernel = nullptr;
+
+  // the cloud settings the grain was last brought up to, see
+  // Cloud::prepared()
+  unsigned settings = 0;
+
+  // sample grains play a window of a corpus sound, picked by sourceRatio
+  // and transposed by the grain frequency
+  static const int sampleWaveForm = 5;
+  const CorpusSound* source = nullptr;
+  float sourceRatio = 0;
+  double sourceStart = 0;
+  double sourceIncrement = 1;
+
+  Grain(float s, float minFreq, float maxFreq, float freqRatio, float duration, float rate) {
+    sampleRate = rate;
+    frequnecyRatio = freqRatio;
+    minFrequency = minFreq;
+    maxFrequency = maxFreq;
+    setFrequency(minFrequency + freqRatio * (maxFrequency - minFrequency));
+
+    startTimeRatio = s;
+
+    resetDuation(duration);
+  }
+
+  void selectEnvelopeType(int t) {
+    envlopeType = t;
+    selectKernel();
+  }
+
+  void selectWaveformType(int t) {
+    waveFormType = t;
+    selectKernel();
+  }
+
+  void selectKernel() {
+    kernel = grainKernel(waveFormType, envlopeType, source != nullptr);
+  }
+
+  // adds the next n samples of the grain to out, returns how many of them
+  // the grain lasted
+  unsigned render(float* out, unsigned n) {
+    return kernel(*this, out, n);
+  }
+
+  float hasNext() {
+    return (currentPosInSamples < grainDurationInSamples);
+  }
+
+  // continuous form of the envelopes at pos samples into a grain of length
+  // samples, zero outside of it
+  static float envelopeAt(int type, float pos, unsigned length) {
+    if(pos < 0 || pos >= length) return 0;
+
+    float x = pos / length;
+    if(type == 0) return 1 - fabsf(2 * x - 1);
+    return hannWindow().get(x * hannWindow().size);
+  }
+
+  // every playback of a grain starts from the same phase so that a cloud
+  // always renders the same samples for the same parameters
+  void reset() {
+    currentPosInSamples = 0;
+  }
+
+  void resetDuation(float duration) {
+    grainDuration = duration;
+    grainDurationInSamples = (duration / 1000.0f) * sampleRate;
+
+    // the linear envelope ramps up and down over half the duration each
+    float half = grainDuration / 2.0f * sampleRate / 1000.0f;
+    attackLength = ceilf(half);
+    rampIncrement = (half > 0) ? 1.0f / half : 1.0f;
+    hannStep = 0.5f / grainDurationInSamples;
+
+    reset();
+  }
+
+  void resetFrequencyBand(float minFreq, float maxFreq) {
+    minFrequency = minFreq;
+    maxFrequency = maxFreq;
+    setFrequency(minFrequency + frequnecyRatio * (maxFrequency - minFrequency));
+  }
+
+  void setFrequency(float f) {
+    frequency = f;
+    increment = frequency / sampleRate;
+    phaseIncrement = (uint32_t)llround((increment - floor(increment)) * 4294967296.0);
+  }
+
+  // finds the corpus window the grain reads, keeping its progress through it
+  void attachSource(const SampleCorpus* corpus) {
+    source = nullptr;
+
+    if(corpus != nullptr && !corpus->sounds.empty()) {
+      sourceIncrement = frequency / corpus->rootFrequency();
+      unsigned length = ceil(grainDurationInSamples * sourceIncrement) + 1;
+
+      unsigned start = 0;
+      source = corpus->locate(sourceRatio, length, start);
+      sourceStart = start;
+    }
+
+    selectKernel();
+  }
+
+};
+
+// Grain kernels are specialized on the waveform and the envelope, each a
+// branch-free function of the position in the grain, so the loop of a
+// kernel carries nothing from one sample to the next. A new waveform or
+// envelope is a new specialization and a larger count below.
+template <int WaveForm> struct GrainWaveForm;
+template <int Envelope> struct GrainEnvelope;
+
+static const int grainWaveFormCount = 6;
+static const int grainEnvelopeCount = 2;
+
+// what the kernels read on every sample: the grain's parameters, copied
+// so that stores to the output can't alias them
+struct GrainRun {
+  float increment, rampIncrement, hannStep;
+  uint32_t phaseIncrement;
+  unsigned attackLength;
+  const CorpusSound* source;
+  double sourceStart, sourceIncrement;
+
+  explicit GrainRun(const Grain& g)
+    : increment(g.increment), rampIncrement(g.rampIncrement), hannStep(g.hannStep),
+      phaseIncrement(g.phaseIncrement),
+      attackLength(g.attackLength), source(g.source), sourceStart(g.sourceStart),
+      sourceIncrement(g.sourceIncrement) {}
+};
+
+// oscillator phase in [0, 1) at a position. The product wraps around
+// exactly in fixed point, so the phase stays as exact as a running one
+// over a whole grain, in 32-bit integer operations that vectorize.
+inline float grainPhase(const GrainRun& g, unsigned pos) {
+  uint32_t phase = pos * g.phaseIncrement;
+  return (int)(phase >> 8) * (1.0f / (1 << 24));
+}
+
+// sin(2 pi phase) for a phase in [0, 1), from a minimax polynomial rather
+// than the sine table so that the kernel needs no gathers. It is within
+// 1e-6 of sin(), about as close as the interpolated table.
+inline float sinCycle(float phase) {
+  // sin(2 pi phase) = -sin(2 pi q), and sin(2 pi |q|) is folded onto
+  // [0, 1/4] with sin(pi - x) = sin(x), without branches
+  float q = phase - 0.5f;
+  float x = (0.25f - fabsf(fabsf(q) - 0.25f)) * (float)(2 * M_PI);
+
+  float x2 = x * x;
+  float p = -1.8363670028513588e-4f;
+  p = p * x2 + 8.3063260280506600e-3f;
+  p = p * x2 - 1.6664828500207957e-1f;
+  p = p * x2 + 9.9999661638757640e-1f;
+  return -copysignf(x * p, q);
+}
+
+template <> struct GrainWaveForm<0> { // sine
+  static float at(const GrainRun& g, unsigned pos) { return sinCycle(grainPhase(g, pos)); }
+};
+
+template <> struct GrainWaveForm<1> { // saw
+  static float at(const GrainRun& g, unsigned pos) { return 2 * grainPhase(g, pos) - 1; }
+};
+
+template <> struct GrainWaveForm<2> { // triangle
+  static float at(const GrainRun& g, unsigned pos) {
+    return 1 - 4 * fabsf(grainPhase(g, pos) - 0.5f);
+  }
+};
+
+template <> struct GrainWaveForm<3> { // square
+  static float at(const GrainRun& g, unsigned pos) { return (grainPhase(g, pos) < 0.5f) ? 1.0f : -1.0f; }
+};
+
+template <> struct GrainWaveForm<4> { // impulse
+  static float at(const GrainRun& g, unsigned pos) { return (grainPhase(g, pos) < g.increment) ? 1.0f : 0.0f; }
+};
+
+template <> struct GrainWaveForm<Grain::sampleWaveForm> {
+  static float at(const GrainRun& g, unsigned pos) { return g.source->at(g.sourceStart + pos * g.sourceIncrement); }
+};
+
+template <> struct GrainEnvelope<0> { // linear attack and decay
+  static float at(const GrainRun& g, unsigned pos) {
+    float x = (int)(pos + 1); // signed converts to float in one instruction
+    float rise = x * g.rampIncrement;
+    float fall = 1 - (x - (int)g.attackLength) * g.rampIncrement;
+    return max(0.0f, min(rise, fall));
+  }
+};
+
+template <> struct GrainEnvelope<1> { // hann
+  // sin^2(pi x) = 0.5 - 0.5 cos(2 pi x)
+  static float at(const GrainRun& g, unsigned pos) {
+    float s = sinCycle((int)pos * g.hannStep);
+    return s * s;
+  }
+};
+
+// out never overlaps a grain, and saying so lets the loop vectorize, at
+// any optimization level. The build targets baseline x86-64, so an AVX2
+// copy is picked at run time where the CPU has it, which halves the time
+// of a saturated day.
+template <int WaveForm, int Envelope>
+AGS_KERNEL
+unsigned renderGrain(Grain& g, float* __restrict out, unsigned n) {
+  unsigned from = g.currentPosInSamples;
+  unsigned count = min(n, g.grainDurationInSamples - min(from, g.grainDurationInSamples));
+  GrainRun run(g);
+
+  for(unsigned k = 0; k < count; k++)
+    out[k] += GrainWaveForm<WaveForm>::at(run, from + k) * GrainEnvelope<Envelope>::at(run, from + k);
+
+  g.currentPosInSamples = from + count;
+  return count;
+}
+
+// unknown waveforms, and sample grains without a corpus window, are silent
+inline unsigned renderSilentGrain(Grain& g, float*, unsigned n) {
+  unsigned from = g.currentPosInSamples;
+  unsigned count = min(n, g.grainDurationInSamples - min(from, g.grainDurationInSamples));
+
+  g.currentPosInSamples = from + count;
+  return count;
+}
+
+template <int WaveForm, int... Envelope>
+array<GrainKernel, grainEnvelopeCount> grainKernelRow(integer_sequence<int, Envelope...>) {
+  return {{ &renderGrain<WaveForm, Envelope>... }};
+}
+
+template <int... WaveForm>
+array<array<GrainKernel, grainEnvelopeCount>, grainWaveFormCount> grainKernelTable(integer_sequence<int, WaveForm...>) {
+  return {{ grainKernelRow<WaveForm>(make_integer_sequence<int, grainEnvelopeCount>())... }};
+}
+
+inline GrainKernel grainKernel(int waveFormType, int envelopeType, bool hasSource) {
+  static const auto table = grainKernelTable(make_integer_sequence<int, grainWaveFormCount>());
+
+  if(waveFormType < 0 || waveFormType >= grainWaveFormCount) return renderSilentGrain;
+  if(waveFormType == Grain::sampleWaveForm && hasSource == false) return renderSilentGrain;
+
+  // any envelope but the linear one is a hann window, as before
+  int envelope = (envelopeType >= 0 && envelopeType < grainEnvelopeCount) ? envelopeType : 1;
+  return table[waveFormType][envelope];
+}
+
+// 32 well-mixed bits from a seed and an index, drawn without touching
+// the random sequence grain schedules come from
+inline uint32_t hashBits(unsigned seed, unsigned i) {
+  uint64_t x = ((uint64_t)seed << 32 | i) + 0x9E3779B97F4A7C15ull;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+  x ^= x >> 31;
+  return x >> 32;
+}
+
+// uniform value in [0, 1) from a seed and an index
+inline float hashToUnit(unsigned seed, unsigned i) {
+  return (hashBits(seed, i) >> 8) / (float)(1 << 24);
+}
+
+// one entry of the grain cache, with the slot of the same index
+struct CachedGrain {
+  uint64_t key = 0;
+  unsigned length = 0;
+  unsigned renderedLength = 0; // samples rendered so far
+  unsigned lastBlock = 0;      // last block it was asked for in
+  int nextInBucket = -1;
+  int newer = -1, older = -1;  // order of use
+};
+
+// Grains rendered once per quantized frequency, duration, waveform and
+// envelope. Every grain of a cloud starts at phase 0 and only differs in
+// frequency, so with frequencies rounded to a few cents most grains of a
+// dense cloud are copies of each other.
+// Storage is a set of slots of the longest grain, allocated by setup(). A
+// grain is rendered into its slot as it first plays, a block at a time, so
+// filling the cache costs no more than synthesizing the grains would.
+// When the slots run out the least recently used grains are dropped,
+// never one asked for in this block or the last, i.e. one still playing.
+struct GrainCache {
+  float cents = 5.0f; // frequency resolution
+  float sampleRate = 44100.0f;
+  size_t capacityInBytes = 64 << 20;
+
+  // bumped when cents change, so that clouds know to look their grains up
+  // again
+  unsigned generation = 0;
+
+  unsigned slotLength = 0;
+  vector<CachedGrain> entries;
+  vector<float> storage;
+  vector<int> buckets; // power of two, of entry chains by key
+  vector<int> freeEntries;
+  int newest = -1, oldest = -1;
+  unsigned block = 0;
+
+  unsigned hits = 0, misses = 0;
+
+  // what a cloud keeps of one of its grains: its key, 0 until it is first
+  // mixed, the entry it was last found at, and whether the current
+  // playback of the grain is synthesized instead
+  struct Ref {
+    uint64_t key = 0;
+    int entry = -1;
+    bool synthesized = false;
+  };
+
+  // grains are up to maxLength samples long, longer ones are never cached.
+  // Not for the audio thread.
+  void setup(float rate, unsigned maxLength) {
+    sampleRate = rate;
+    slotLength = maxLength;
+    size_t count = (slotLength > 0) ? capacityInBytes / (slotLength * sizeof(float)) : 0;
+
+    entries.assign(count, CachedGrain());
+    if(storage.size() != count * slotLength) {
+      vector<float>().swap(storage);
+      storage.assign(count * slotLength, 0.0f);
+    }
+
+    size_t bucketCount = 1;
+    while(bucketCount < 2 * count) bucketCount *= 2;
+    buckets.assign(bucketCount, -1);
+
+    freeEntries.clear();
+    freeEntries.reserve(count);
+    for(int i = (int)count - 1; i >= 0; i--) freeEntries.push_back(i);
+    newest = oldest = -1;
+    generation++;
+  }
+
+  // identifies a grain by its rounded frequency rather than by the rounding
+  // step, so that entries stay valid when cents change
+  uint64_t keyOf(float frequency, unsigned lengthInSamples, int waveFormType, int envelopeType) const {
+    float quantized = mtof(lround(ftom(frequency) * 100.0 / cents) * cents / 100.0f);
+    uint32_t bits;
+    memcpy(&bits, &quantized, sizeof(bits));
+
+    return ((uint64_t)bits << 32) | ((uint64_t)min(lengthInSamples, 0xffffffu) << 8)
+      | ((uint64_t)(waveFormType & 0xf) << 4) | (uint64_t)(envelopeType & 0xf);
+  }
+
+  // samples from offset to offset + count of a grain, rendering the ones
+  // not cached yet. nullptr when they can't be, i.e. the grain is longer
+  // than a slot, every slot is in use, or the grain is first asked for
+  // past the samples rendered so far; the caller synthesizes it then.
+  const float* get(Ref& ref, unsigned offset, unsigned count) {
+    uint64_t key = ref.key;
+    int i = (ref.entry >= 0 && entries[ref.entry].key == key) ? ref.entry : find(key);
+
+    if(i < 0) {
+      unsigned length = (key >> 8) & 0xffffff;
+      if(offset > 0 || length > slotLength) {
+        misses++;
+        return nullptr;
+      }
+
+      if(freeEntries.empty()) dropOldest();
+      if(freeEntries.empty()) {
+        misses++;
+        return nullptr;
+      }
+
+      i = freeEntries.back();
+      freeEntries.pop_back();
+
+      CachedGrain& e = entries[i];
+      e.key = key;
+      e.length = length;
+      e.renderedLength = 0;
+      int& bucket = buckets[bucketOf(key)];
+      e.nextInBucket = bucket;
+      bucket = i;
+      linkNewest(i);
+    }
+
+    ref.entry = i;
+    CachedGrain& e = entries[i];
+    touch(i);
+
+    if(offset > e.renderedLength) {
+      misses++;
+      return nullptr;
+    }
+
+    unsigned end = min(offset + count, e.length);
+    if(end > e.renderedLength) {
+      render(i, end);
+      misses++;
+    } else {
+      hits++;
+    }
+    return slotSamples(i) + offset;
+  }
+
+  // grains keep their rounded frequency, and those of the old rounding
+  // age out of the cache
+  void reset(float c) {
+    cents = c;
+    generation++;
+  }
+
+  // between blocks
+  void nextBlock() {
+    block++;
+  }
+
+ private:
+  float* slotSamples(int i) { return &storage[(size_t)i * slotLength]; }
+
+  // renders entry i up to sample end
+  void render(int i, unsigned end) {
+    CachedGrain& e = entries[i];
+
+    float frequency;
+    uint32_t bits = e.key >> 32;
+    memcpy(&frequency, &bits, sizeof(bits));
+
+    Grain grain(0, frequency, frequency, 0, e.length * 1000.0f / sampleRate, sampleRate);
+    grain.selectWaveformType((e.key >> 4) & 0xf);
+    grain.selectEnvelopeType(e.key & 0xf);
+    grain.currentPosInSamples = e.renderedLength;
+
+    float* samples = slotSamples(i);
+    fill(samples + e.renderedLength, samples + end, 0.0f);
+    grain.render(samples + e.renderedLength, end - e.renderedLength);
+    e.renderedLength = end;
+  }
+
+  size_t bucketOf(uint64_t key) const {
+    return hashBits(key >> 32, (uint32_t)key) & (buckets.size() - 1);
+  }
+
+  int find(uint64_t key) const {
+    if(buckets.empty()) return -1;
+
+    for(int i = buckets[bucketOf(key)]; i >= 0; i = entries[i].nextInBucket)
+      if(entries[i].key == key) return i;
+    return -1;
+  }
+
+  void touch(int i) {
+    if(entries[i].lastBlock == block) return;
+    entries[i].lastBlock = block;
+    if(newest == i) return;
+    unlink(i);
+    linkNewest(i);
+  }
+
+  void linkNewest(int i) {
+    entries[i].older = newest;
+    entries[i].newer = -1;
+    if(newest >= 0) entries[newest].newer = i;
+    newest = i;
+    if(oldest < 0) oldest = i;
+  }
+
+  void unlink(int i) {
+    CachedGrain& e = entries[i];
+    if(e.newer >= 0) entries[e.newer].older = e.older;
+    else newest = e.older;
+    if(e.older >= 0) entries[e.older].newer = e.newer;
+    else oldest = e.newer;
+    e.newer = e.older = -1;
+  }
+
+  void dropOldest() {
+    int i = oldest;
+    if(i < 0 || block - entries[i].lastBlock <= 1) return;
+
+    int* link = &buckets[bucketOf(entries[i].key)];
+    while(*link != i) link = &entries[*link].nextInBucket;
+    *link = entries[i].nextInBucket;
+
+    unlink(i);
+    entries[i] = CachedGrain();
+    freeEntries.push_back(i);
+  }
+};
+
+// Renders sine grains a frame at a time with inverse-FFT overlap-add. Each
+// grain adds the spectrum of a hann-windowed partial to the frame, with its
+// envelope taken as a linear ramp across the frame, and one inverse FFT per
+// hop then yields all grains together. Frames overlap by half, so the
+// windows sum to one.
+struct SpectralSynth {
+  static const int kernelRadius = 4;      // bins on each side of a partial
+  static const int tableResolution = 64;  // kernel table steps per bin
+
+  float sampleRate = 44100.0f;
+  unsigned frameSize = 0;
+  unsigned hopSize = 0;
+
+  FFT fft;
+  vector<complex<float>> spectrum;
+
+  // spectra of the window and of the window times (n - frameSize / 2),
+  // sampled from -kernelRadius - 1 to kernelRadius + 1 bins
+  vector<complex<float>> flatKernel, slopeKernel;
+
+  void setup(float rate, unsigned size) {
+    sampleRate = rate;
+    frameSize = size;
+    hopSize = frameSize / 2;
+
+    fft.setup(frameSize);
+    spectrum.assign(frameSize, 0);
+
+    unsigned tableSize = 2 * (kernelRadius + 1) * tableResolution + 2;
+    flatKernel.resize(tableSize);
+    slopeKernel.resize(tableSize);
+
+    for(unsigned t = 0; t < tableSize; t++) {
+      double nu = (double)t / tableResolution - (kernelRadius + 1);
+      complex<double> flat = 0, slope = 0;
+
+      for(unsigned n = 0; n < frameSize; n++) {
+        double w = 0.5 - 0.5 * cos(2 * M_PI * n / frameSize);
+        complex<double> e = std::polar(1.0, -2 * M_PI * nu * n / frameSize);
+        flat += w * e;
+        slope += w * (n - frameSize / 2.0) * e;
+      }
+
+      flatKernel[t] = complex<float>(flat);
+      slopeKernel[t] = complex<float>(slope);
+    }
+  }
+
+  void clear() {
+    fill(spectrum.begin(), spectrum.end(), complex<float>(0));
+  }
+
+  // adds (amplitude + slope * (n - frameSize / 2)) * sin(phase + n * w) to
+  // the frame, where w is the angular frequency of frequency
+  void addPartial(float frequency, double phase, float amplitude, float slope) {
+    float bin = frequency * frameSize / sampleRate;
+
+    // sin(x) = (e^(ix) - e^(-ix)) / 2i
+    complex<float> positive = complex<float>(std::polar(0.5, phase - M_PI / 2));
+    complex<float> negative = complex<float>(std::polar(0.5, M_PI / 2 - phase));
+
+    addKernel(bin, positive, amplitude, slope);
+    addKernel(-bin, negative, amplitude, slope);
+  }
+
+  // writes the real part of the frame's inverse transform into frame
+  void synthesize(float* frame) {
+    fft.inverse(&spectrum[0]);
+
+    float scale = 1.0f / frameSize;
+    for(unsigned n = 0; n < frameSize; n++) frame[n] = spectrum[n].real() * scale;
+  }
+
+ private:
+  void addKernel(float bin, complex<float> weight, float amplitude, float slope) {
+    int first = ceilf(bin - kernelRadius);
+    int last = floorf(bin + kernelRadius);
+
+    for(int k = first; k <= last; k++) {
+      float t = (k - bin + kernelRadius + 1) * tableResolution;
+      unsigned i = (unsigned)t;
+      float f = t - i;
+
+      complex<float> flat = flatKernel[i] + f * (flatKernel[i + 1] - flatKernel[i]);
+      complex<float> ramp = slopeKernel[i] + f * (slopeKernel[i + 1] - slopeKernel[i]);
+
+      int bucket = k % (int)frameSize;
+      if(bucket < 0) bucket += frameSize;
+      spectrum[bucket] += weight * (amplitude * flat + slope * ramp);
+    }
+  }
+};
+
+// The envelope is only followed linearly within a frame, so frames have to
+// be short next to the grains. Frames of at most a twelfth of the grain
+// length keep the output within -35 dB (relative RMS error) of time-domain
+// synthesis for every grain duration, with kernels cut off kernelRadius
+// bins from each partial; make check measures it.
+struct SpectralBank {
+  static const unsigned minFrameSize = 64;
+  static const unsigned maxFrameSize = 1024;
+
+  float sampleRate = 44100.0f;
+  vector<SpectralSynth> synths; // one per power-of-two frame size
+
+  // builds the kernel tables of every frame size, so that none is built
+  // while rendering
+  void setup(float rate) {
+    if(rate == sampleRate && synths.empty() == false) return;
+
+    sampleRate = rate;
+    synths.clear();
+    for(unsigned size = minFrameSize; size <= maxFrameSize; size *= 2) {
+      synths.push_back(SpectralSynth());
+      synths.back().setup(sampleRate, size);
+    }
+  }
+
+  SpectralSynth* forGrainLength(unsigned length) {
+    unsigned i = 0;
+    while(i + 1 < synths.size() && (minFrameSize << (i + 1)) <= length / 12) i++;
+    return &synths[i];
+  }
+};
+
+struct Cloud {
+  vector<Grain*> grains;        // in order of their start
+  vector<unsigned> grainStarts; // of each grain, in samples
+
+  // the grains themselves, side by side in the order they start, so that
+  // the grains sounding together share cache lines
+  vector<Grain> grainStorage;
+  vector<unsigned> drawOrder; // draw each grain of grainStorage was made from
+
+  // grains are scattered from a per-cloud seed so that the same seed
+  // always yields the same grain schedule
+  unsigned seed = 0;
+  vector<float> draws; // start of the seed's random sequence
+
+  // first day it plays on and its band, only used to label trace events
+  unsigned day = 0, band = 0;
+
+  float sampleRate = 44100.0f;
+
+  unsigned hopSize;
+  float minFrequency;
+  float maxFrequency;
+  float minMidi;
+  float maxMidi;
+
+  float grainDensity;
+  float grainDuration; // milliseconds
+  float cloudDuration; // milliseconds
+
+  // shared by every grain of the schedule
+  unsigned grainDurationInSamples = 0;
+  float maxStartTimeRatio = 0;
+
+  // bumped whenever the settings grains take change
+  unsigned grainSettings = 1;
+  
+  float increment;
+  float time;
+  unsigned cloudSampleIndex;
+  unsigned cloudDurationInSamples;
+  int grainWaveFormType = 0;
+  int grainEnvType = 0;
+
+  // grains are mixed from pre-rendered copies while this is set
+  GrainCache* grainCache = nullptr;
+  vector<GrainCache::Ref> cachedGrains;
+  unsigned cachedGrainsGeneration = 0;
+  bool cachedGrainsValid = false;
+
+  // grains sounding in the block being rendered are [firstActiveGrain,
+  // endActiveGrain), both only move forward between resets
+  unsigned firstActiveGrain = 0, endActiveGrain = 0;
+  // where grains start and end in the block being rendered, see
+  // countGrain()
+  vector<unsigned> grainEdges;
+
+  // sine grains are rendered with inverse-FFT overlap-add while at least
+  // spectralThreshold grains sound at once
+  SpectralBank* spectralBank = nullptr;
+  SpectralSynth* spectral = nullptr;
+  unsigned spectralThreshold = 0;
+  bool spectralActive = false;
+  bool spectralPrimed = false;
+  unsigned spectralNextFrame = 0;
+  int spectralHopStart = 0;
+  vector<float> spectralHop, spectralTail, spectralFrame;
+
+  // where sample grains read from
+  const SampleCorpus* corpus = nullptr;
+  unsigned corpusGeneration = 0;
+
+  void reset() {
+    // time = 0;
+    // grainTimer = 0;
+    cloudSampleIndex = 0;
+    firstActiveGrain = endActiveGrain = 0;
+    spectralActive = false;
+    spectralPrimed = false;
+  }
+  
+  bool hasNext() {
+    return (cloudSampleIndex < cloudDurationInSamples);
+  }
+
+  Cloud() {}
+  Cloud(const Cloud&) = delete;
+  Cloud& operator=(const Cloud&) = delete;
+
+  void setGrains(float rate, unsigned s, float density, float midiLow, float midiHigh, float gDuration, float duration) {
+    // as a cumulus cloud, grains are randomly scattered whithin a given frequency band
+    sampleRate = rate;
+    seed = s;
+    minMidi = midiLow;
+    maxMidi = midiHigh;
+    minFrequency = mtof(minMidi);
+    maxFrequency = mtof(maxMidi);
+    grainDensity = density;
+    cloudDuration = duration;
+    grainDuration = gDuration;
+
+    cloudDurationInSamples = (duration / 1000.0f) * sampleRate;
+    cloudSampleIndex = 0;
+
+    scatterGrains();
+  }
+
+  // Grains are built once, for clouds up to the longest the interface
+  // offers, and a cloud duration picks the first of them in the order they
+  // were drawn, so that a new duration doesn't rebuild every grain of every
+  // band in one block.
+  void scatterGrains() {
+    unsigned grainSize = grainDensity * (cloudDuration / 1000.0f);
+
+    // Each grain takes two draws of the sequence, so a new duration only
+    // takes more or fewer of the same ones. Seeding the generator costs
+    // more than the rest of the schedule, so it is done once too.
+    if(grainStorage.size() < grainSize) {
+      unsigned count = max(grainSize, (unsigned)(grainDensity * 0.5f));
+
+      mt19937 rng(seed);
+      uniform_real_distribution<float> random(0.0f, 1.0f);
+      draws.resize(2 * count);
+      for(auto& d : draws) d = random(rng);
+
+      // in order of the draws their start times are scaled from, which is
+      // the order of the start times whatever the durations
+      drawOrder.resize(count);
+      for(unsigned i = 0; i < count; i++) drawOrder[i] = i;
+      sort(drawOrder.begin(), drawOrder.end(), [this](unsigned a, unsigned b) {
+        return draws[2 * a + 1] < draws[2 * b + 1] || (draws[2 * a + 1] == draws[2 * b + 1] && a < b);
+      });
+
+      grainStorage.clear();
+      grainStorage.reserve(count);
+      grains.reserve(count);
+
+      for(unsigned i : drawOrder) {
+        grainStorage.emplace_back(0.0f, minFrequency, maxFrequency, draws[2 * i], grainDuration, sampleRate);
+        grainStorage.back().sourceRatio = hashToUnit(seed, i);
+      }
+    }
+
+    grains.clear();
+    for(unsigned k = 0; k < drawOrder.size(); k++)
+      if(drawOrder[k] < grainSize) grains.push_back(&grainStorage[k]);
+
+    scheduleGrains();
+  }
+
+  float startDraw(const Grain* g) const {
+    return draws[2 * drawOrder[g - &grainStorage[0]] + 1];
+  }
+
+  // lays the grains out over the cloud for the current durations. A new
+  // grain duration keeps their order, so it only needs this, rather than
+  // scattering the grains again.
+  void scheduleGrains() {
+    cachedGrainsValid = false;
+    firstActiveGrain = endActiveGrain = 0;
+    grainSettings++;
+
+    grainDurationInSamples = (grainDuration / 1000.0f) * sampleRate;
+
+    // grains longer than the cloud all start with it
+    maxStartTimeRatio = max(0.0f, (cloudDuration - grainDuration) / cloudDuration);
+
+    // at most one grain starts per sample, later ones are pushed back
+    grainStarts.resize(grains.size());
+    for(unsigned i = 0; i < grains.size(); i++) {
+      float ratio = startTimeRatioOf(grains[i]);
+      unsigned start = ceil(ratio * cloudDurationInSamples);
+      grainStarts[i] = (i > 0) ? max(start, grainStarts[i - 1] + 1) : start;
+    }
+  }
+
+  // where a grain sits with the current settings, which it only takes
+  // itself once it plays
+  float startTimeRatioOf(const Grain* g) const {
+    return startDraw(g) * maxStartTimeRatio;
+  }
+
+  float frequencyOf(const Grain* g) const {
+    return minFrequency + g->frequnecyRatio * (maxFrequency - minFrequency);
+  }
+
+  // Settings reach a grain when it next sounds rather than when they
+  // change, so that a change only costs a cloud its grains that play.
+  Grain* prepared(Grain* g) {
+    if(g->settings == grainSettings) return g;
+
+    g->startTimeRatio = startTimeRatioOf(g);
+    g->resetFrequencyBand(minFrequency, maxFrequency);
+    g->resetDuation(grainDuration);
+    g->waveFormType = grainWaveFormType;
+    g->envlopeType = grainEnvType;
+    g->attachSource(corpus);
+
+    g->settings = grainSettings;
+    return g;
+  }
+  
+  void selectWaveformType(int type) {
+    grainWaveFormType = type;
+    cachedGrainsValid = false;
+    grainSettings++;
+  }
+
+  void selectEnvelopeType(int type) {
+    grainEnvType = type;
+    cachedGrainsValid = false;
+    grainSettings++;
+  }
+
+  void resetFrequencyBand(float midiLow, float midiHigh) {
+    cachedGrainsValid = false;
+    minMidi = midiLow;
+    maxMidi = midiHigh;
+    minFrequency = mtof(minMidi);
+    maxFrequency = mtof(maxMidi);
+    grainSettings++;
+  }
+
+  void resetCloudDuration(float duration) {
+    //printf("grainSize: %d\n", grains.size());
+
+    cloudDuration = duration;
+    cloudDurationInSamples = (duration / 1000.0f) * sampleRate;
+
+    // the grain schedule is rebuilt from the seed rather than patched, so a
+    // cloud duration always maps to the same set of grains
+    scatterGrains();
+
+    reset();
+  }
+
+  void resetGrainDuration(float duration) {
+    grainDuration = duration;
+
+    // start times are bounded by the grain duration, so the schedule is
+    // laid out again and playback continues from the current position
+    scheduleGrains();
+    seek(cloudSampleIndex);
+  }
+
+  // moves the cloud to a given sample position as if it had been played
+  // up to there, e.g. after a stretch was served from a cached block.
+  // Grains are placed from the schedule as the cloud renders, so this only
+  // moves the position.
+  void seek(unsigned pos) {
+    reset();
+    cloudSampleIndex = min(pos, cloudDurationInSamples);
+  }
+
+  void setGrainCache(GrainCache* cache) {
+    grainCache = cache;
+    cachedGrainsValid = false;
+  }
+
+  void setCorpus(const SampleCorpus* c) {
+    corpus = c;
+    corpusGeneration = (c != nullptr) ? c->generation : 0;
+    grainSettings++;
+  }
+
+  void setSpectralBank(SpectralBank* bank, unsigned threshold) {
+    spectralBank = bank;
+    spectralThreshold = threshold;
+    spectralActive = false;
+    spectralPrimed = false;
+  }
+
+  void render(float* out, unsigned n) {
+    if(grains.empty()) {
+      fill(out, out + n, 0.0f);
+      cloudSampleIndex = min(cloudSampleIndex + n, cloudDurationInSamples);
+      return;
+    }
+
+    // sample grains differ by their corpus window, not only by frequency
+    if(grainCache != nullptr && grainWaveFormType != Grain::sampleWaveForm) {
+      renderFromGrainCache(out, n);
+      return;
+    }
+
+    if(useSpectralFor(n)) {
+      renderSpectral(out, n);
+      return;
+    }
+
+    renderGrains(out, n);
+  }
+
+  // every sounding grain is run over its part of the block and each sample
+  // is averaged over the grains sounding there. Grains are sorted by start
+  // time and share one length, so where each one is follows from the
+  // schedule and the position of the cloud.
+  void renderGrains(float* out, unsigned n) {
+    startCounting();
+    fill(out, out + n, 0.0f);
+
+    unsigned from = cloudSampleIndex;
+
+    findActiveGrains(n);
+    for(unsigned i = firstActiveGrain; i < endActiveGrain; i++) {
+      unsigned start = grainStart(i);
+      unsigned offset = (start > from) ? start - from : 0;
+
+      Grain* g = prepared(grains[i]);
+      g->currentPosInSamples = from + offset - start;
+      unsigned count = g->render(out + offset, n - offset);
+      countGrain(offset, offset + count);
+
+      if(start >= from) traceInstant("grain start", "day band", day, band);
+    }
+
+    averageOverGrains(out, n);
+    cloudSampleIndex = min(from + n, cloudDurationInSamples);
+  }
+
+  // Each sample is averaged over the grains sounding there, which only
+  // change where grains start and end: those are noted by the renderers
+  // and the block is walked from one to the next, rather than counting
+  // every grain at every sample.
+  void startCounting() {
+    grainEdges.clear();
+  }
+
+  // a grain sounding over samples [a, b) of the block, noted as twice the
+  // sample, plus one for an end
+  void countGrain(unsigned a, unsigned b) {
+    grainEdges.push_back(2 * a);
+    grainEdges.push_back(2 * b + 1);
+  }
+
+  // samples without any grain are silent
+  void averageOverGrains(float* out, unsigned n) {
+    sort(grainEdges.begin(), grainEdges.end());
+    grainEdges.push_back(2 * n);
+
+    int count = 0;
+    unsigned k = 0;
+    for(unsigned edge : grainEdges) {
+      unsigned end = min(edge / 2, n);
+
+      if(end > k) {
+        if(count == 0) {
+          fill(out + k, out + end, 0.0f);
+        } else if(count > 1) {
+          float c = count;
+          for(unsigned i = k; i < end; i++) out[i] /= c;
+        }
+        k = end;
+      }
+      count += (edge & 1) ? -1 : 1;
+    }
+  }
+
+  unsigned grainStart(unsigned i) const {
+    return grainStarts[i];
+  }
+
+  // whether any grain of the schedule sounds in the next n samples
+  bool soundsWithin(unsigned n) const {
+    if(grains.empty()) return false;
+
+    unsigned from = cloudSampleIndex, to = from + n;
+
+    // grains are sorted by start time and share one length
+    unsigned length = grainDurationInSamples;
+    auto it = std::lower_bound(grainStarts.begin(), grainStarts.end(), from, [&](unsigned start, unsigned t) {
+      return start + length <= t;
+    });
+    return it != grainStarts.end() && *it < to;
+  }
+
+  // moves n samples ahead over a stretch where soundsWithin(n) is false,
+  // which leaves every grain where it is
+  void skipSilence(unsigned n) {
+    cloudSampleIndex = min(cloudSampleIndex + n, cloudDurationInSamples);
+  }
+
+  // moves n samples ahead without rendering them, the grains pick up from
+  // there when the cloud is rendered again
+  void skip(unsigned n) {
+    cloudSampleIndex = min(cloudSampleIndex + n, cloudDurationInSamples);
+  }
+
+  // moves [firstActiveGrain, endActiveGrain) onto the grains sounding at
+  // some point of the next n samples. Grains are sorted by start time and
+  // share one length, so both ends only step forward as the cloud plays.
+  void findActiveGrains(unsigned n) {
+    unsigned from = cloudSampleIndex, to = from + n;
+    unsigned length = grainDurationInSamples;
+
+    while(firstActiveGrain < grains.size() && grainStart(firstActiveGrain) + length <= from)
+      firstActiveGrain++;
+
+    endActiveGrain = max(endActiveGrain, firstActiveGrain);
+    while(endActiveGrain < grains.size() && grainStart(endActiveGrain) < to) endActiveGrain++;
+    // a shorter block than the last one
+    while(endActiveGrain > firstActiveGrain && grainStart(endActiveGrain - 1) >= to) endActiveGrain--;
+  }
+
+  // number of grains sounding at some point of the next n samples
+  unsigned activeGrains(unsigned n) {
+    findActiveGrains(n);
+    return endActiveGrain - firstActiveGrain;
+  }
+
+  // switches between time-domain and spectral synthesis, with some
+  // hysteresis so that a cloud hovering around the threshold stays put
+  bool useSpectralFor(unsigned n) {
+    if(spectralBank == nullptr || spectralThreshold == 0 || grainWaveFormType != 0 || grains.empty()) {
+      spectralActive = false;
+      return false;
+    }
+
+    unsigned active = activeGrains(n);
+    if(spectralActive) spectralActive = (2 * active >= spectralThreshold);
+    else spectralActive = (active >= spectralThreshold);
+
+    if(spectralActive == false) spectralPrimed = false;
+    return spectralActive;
+  }
+
+  // renders frame j, which starts (j - 1) hops after the start of the cloud
+  void synthesizeFrame(unsigned j, float* frame) {
+    unsigned frameSize = spectral->frameSize;
+    unsigned hopSize = spectral->hopSize;
+    int frameStart = ((int)j - 1) * (int)hopSize;
+    float center = frameStart + frameSize / 2.0f;
+
+    spectral->clear();
+
+    // first grain still sounding when the frame starts
+    unsigned length = grainDurationInSamples;
+    unsigned first = std::lower_bound(grainStarts.begin(), grainStarts.end(), frameStart, [&](unsigned start, int t) {
+      return (int)(start + length) <= t;
+    }) - grainStarts.begin();
+
+    for(unsigned i = first; i < grains.size(); i++) {
+      int start = grainStart(i);
+      if(start >= frameStart + (int)frameSize) break;
+
+      Grain* g = prepared(grains[i]);
+      float amplitude = Grain::envelopeAt(grainEnvType, center - start, length);
+      float slope = (Grain::envelopeAt(grainEnvType, center + hopSize / 2.0f - start, length)
+        - Grain::envelopeAt(grainEnvType, center - hopSize / 2.0f - start, length)) / hopSize;
+
+      double cycles = (double)g->frequency * (frameStart - start) / sampleRate;
+      double phase = 2 * M_PI * (cycles - floor(cycles));
+
+      spectral->addPartial(g->frequency, phase, amplitude, slope);
+    }
+
+    spectral->synthesize(frame);
+  }
+
+  // overlap-adds the next frame onto the tail of the previous one
+  void nextSpectralHop() {
+    unsigned hopSize = spectral->hopSize;
+    unsigned j = spectralNextFrame++;
+    synthesizeFrame(j, &spectralFrame[0]);
+
+    for(unsigned i = 0; i < hopSize; i++) {
+      spectralHop[i] = spectralTail[i] + spectralFrame[i];
+      spectralTail[i] = spectralFrame[hopSize + i];
+    }
+    spectralHopStart = ((int)j - 1) * (int)hopSize;
+  }
+
+  void primeSpectral(unsigned pos) {
+    spectral = spectralBank->forGrainLength(grainDurationInSamples);
+
+    unsigned hopSize = spectral->hopSize;
+    spectralHop.resize(hopSize);
+    spectralTail.resize(hopSize);
+    spectralFrame.resize(spectral->frameSize);
+
+    unsigned i = pos / hopSize;
+    synthesizeFrame(i, &spectralFrame[0]);
+    copy(spectralFrame.begin() + hopSize, spectralFrame.end(), spectralTail.begin());
+
+    spectralNextFrame = i + 1;
+    nextSpectralHop();
+    spectralPrimed = true;
+  }
+
+  void renderSpectral(float* out, unsigned n) {
+    unsigned from = cloudSampleIndex;
+
+    if(spectralPrimed == false || (int)from < spectralHopStart
+      || (int)from >= spectralHopStart + (int)spectral->hopSize)
+      primeSpectral(from);
+
+    unsigned hopSize = spectral->hopSize;
+
+    for(unsigned k = 0; k < n;) {
+      int t = from + k;
+      if(t >= spectralHopStart + (int)hopSize) nextSpectralHop();
+
+      unsigned m = min(n - k, (unsigned)(spectralHopStart + hopSize - t));
+      memcpy(out + k, &spectralHop[t - spectralHopStart], m * sizeof(float));
+      k += m;
+    }
+
+    // average over the grains sounding at each sample, as renderGrains() does
+    startCounting();
+
+    findActiveGrains(n);
+    for(unsigned i = firstActiveGrain; i < endActiveGrain; i++) {
+      unsigned start = grainStart(i);
+
+      unsigned a = max(start, from);
+      unsigned b = min(start + grainDurationInSamples, from + n);
+      countGrain(a - from, b - from);
+
+      if(start >= from) traceInstant("grain start", "day band", day, band);
+    }
+
+    averageOverGrains(out, n);
+
+    cloudSampleIndex = min(from + n, cloudDurationInSamples);
+  }
+
+  // mixes the grains sounding in the next n samples by adding their cached
+  // copies at their offsets, averaged over the number of grains per sample
+  // as renderGrains() does. Grains the cache can't serve are synthesized
+  // in their place.
+  void renderFromGrainCache(float* out, unsigned n) {
+    if(cachedGrainsValid == false || cachedGrainsGeneration != grainCache->generation) {
+      cachedGrains.assign(grains.size(), GrainCache::Ref());
+      cachedGrainsGeneration = grainCache->generation;
+      cachedGrainsValid = true;
+    }
+
+    startCounting();
+    fill(out, out + n, 0.0f);
+
+    unsigned from = cloudSampleIndex;
+    unsigned to = from + n;
+
+    findActiveGrains(n);
+    for(unsigned i = firstActiveGrain; i < endActiveGrain; i++) {
+      Grain* g = prepared(grains[i]);
+      unsigned start = grainStart(i);
+      if(start >= from) traceInstant("grain start", "day band", day, band);
+
+      unsigned a = max(start, from);
+      unsigned b = min(start + g->grainDurationInSamples, to);
+      if(a >= b) continue;
+
+      GrainCache::Ref& ref = cachedGrains[i];
+      if(ref.key == 0) ref.key = grainCache->keyOf(g->frequency, g->grainDurationInSamples, grainWaveFormType, grainEnvType);
+
+      // a grain synthesized once is until it ends, switching over midway
+      // would change its frequency
+      if(a == start) ref.synthesized = false;
+      const float* samples = ref.synthesized ? nullptr : grainCache->get(ref, a - start, b - a);
+      float* o = out + (a - from);
+
+      if(samples != nullptr) {
+        for(unsigned k = 0; k < b - a; k++) o[k] += samples[k];
+      } else {
+        ref.synthesized = true;
+        g->currentPosInSamples = a - start;
+        g->render(o, b - a);
+      }
+      countGrain(a - from, b - from);
+    }
+
+    averageOverGrains(out, n);
+
+    cloudSampleIndex = min(to, cloudDurationInSamples);
+  }
+
+};
+
+// Everything a rendered cloud depends on besides its band and density,
+// which are implied by the cloud it was rendered from.
+struct BlockSignature {
+  float cloudDuration = 0;
+  float grainDuration = 0;
+  float minMidi = 0, maxMidi = 0;
+  int waveFormType = 0;
+  int envelopeType = 0;
+  float grainCacheCents = 0; // 0 when grains are synthesized
+  unsigned spectralThreshold = 0; // 0 without spectral synthesis
+  unsigned corpusGeneration = 0; // 0 for synthetic grains
+
+  static BlockSignature of(const Cloud* c) {
+    BlockSignature s;
+    s.cloudDuration = c->cloudDuration;
+    s.grainDuration = c->grainDuration;
+    s.minMidi = c->minMidi;
+    s.maxMidi = c->maxMidi;
+    s.waveFormType = c->grainWaveFormType;
+    s.envelopeType = c->grainEnvType;
+    s.grainCacheCents = (c->grainCache != nullptr) ? c->grainCache->cents : 0;
+    s.spectralThreshold = (c->spectralBank != nullptr) ? c->spectralThreshold : 0;
+    s.corpusGeneration = (c->grainWaveFormType == Grain::sampleWaveForm) ? c->corpusGeneration : 0;
+    return s;
+  }
+
+  bool operator==(const BlockSignature& o) const {
+    return cloudDuration == o.cloudDuration && grainDuration == o.grainDuration
+      && minMidi == o.minMidi && maxMidi == o.maxMidi
+      && waveFormType == o.waveFormType && envelopeType == o.envelopeType
+      && grainCacheCents == o.grainCacheCents && spectralThreshold == o.spectralThreshold
+      && corpusGeneration == o.corpusGeneration;
+  }
+
+  bool operator!=(const BlockSignature& o) const { return !(*this == o); }
+};
+
+// Fixed-size slots in a memory-mapped file, used as the second tier of the
+// block cache. The kernel pages slots in and out, so only the blocks that
+// are being played take up RAM.
+struct SpillFile {
+  float* slots = nullptr;
+  size_t mappedBytes = 0;
+  unsigned slotLength = 0;
+  unsigned slotCount = 0;
+  vector<int> freeSlots;
+
+  ~SpillFile() { close(); }
+
+  bool open(const char* path, size_t bytes, unsigned length) {
+    close();
+
+    slotLength = length;
+    slotCount = bytes / (length * sizeof(float));
+    if(slotCount == 0) return false;
+
+    int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) return false;
+
+    mappedBytes = (size_t)slotCount * slotLength * sizeof(float);
+    if(ftruncate(fd, mappedBytes) != 0) {
+      ::close(fd);
+      return false;
+    }
+
+    void* p = mmap(nullptr, mappedBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(p == MAP_FAILED) return false;
+
+    slots = (float*)p;
+    freeAllSlots();
+
+    return true;
+  }
+
+  void freeAllSlots() {
+    freeSlots.clear();
+    for(int i = slotCount - 1; i >= 0; i--) freeSlots.push_back(i);
+  }
+
+  void close() {
+    if(slots != nullptr) munmap(slots, mappedBytes);
+    slots = nullptr;
+    mappedBytes = 0;
+    slotCount = 0;
+    freeSlots.clear();
+  }
+
+  bool isOpen() const { return slots != nullptr; }
+
+  float* slot(int i) { return slots + (size_t)i * slotLength; }
+};
+
+// fixed-capacity queue between one producer and one consumer thread that
+// never allocates or locks once set up
+template <typename T>
+struct SpscQueue {
+  vector<T> items; // power of two
+  atomic<size_t> head { 0 }, tail { 0 };
+
+  // only while neither thread uses the queue
+  void setup(size_t capacity) {
+    size_t size = 1;
+    while(size < capacity) size *= 2;
+    items.assign(size, T());
+    head = tail = 0;
+  }
+
+  bool push(const T& item) {
+    size_t h = head.load(std::memory_order_relaxed);
+    if(h - tail.load(std::memory_order_acquire) >= items.size()) return false;
+
+    items[h & (items.size() - 1)] = item;
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T& item) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if(t == head.load(std::memory_order_acquire)) return false;
+
+    item = items[t & (items.size() - 1)];
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+};
+
+// the rendered samples of one cloud
+struct CachedBlock {
+  unsigned band = 0;
+  BlockSignature signature;
+  unsigned length = 0;
+  bool cached = false; // holds a whole rendered cloud
+  bool silent = false;
+  bool pinned = false;
+  bool spilling = false; // being copied to the spill file
+
+  int slot = -1;      // resident samples, -1 when silent or spilled
+  int spillSlot = -1;
+  int newer = -1, older = -1; // order of use, by cloud
+};
+
+// Whole clouds rendered once, kept for the next time they play. Storage is
+// a set of slots of the longest cloud, allocated by reserve() when the
+// clouds are built: voices record straight into a free slot and hand it to
+// the cache when the cloud is complete, so playback never allocates. When
+// the slots run out the least recently used blocks are dropped, or, with
+// a spill file, copied there by a background thread so that the audio
+// thread never touches the file itself.
+struct BlockCache {
+  vector<CachedBlock> blocks; // one per cloud
+  int newest = -1, oldest = -1;
+  unsigned count = 0;
+
+  unsigned slotLength = 0;
+  vector<float> storage;
+  vector<int> freeSlots;
+  size_t capacityInBytes = 0;
+  size_t residentBytes = 0;
+
+  struct SpillJob {
+    int block, slot, spillSlot;
+    unsigned length;
+  };
+  SpillFile spill;
+  SpscQueue<SpillJob> spillRequests, spillsDone;
+  unsigned spillsPending = 0;
+  std::thread spiller;
+  atomic<bool> spillerRunning { false };
+
+  unsigned hits = 0, misses = 0;
+
+  BlockCache() {}
+  BlockCache(const BlockCache&) = delete;
+  BlockCache& operator=(const BlockCache&) = delete;
+
+  ~BlockCache() { stopSpiller(); }
+
+  // blocks are up to maxLength samples long, spillPath adds spillBytes of
+  // slots in a file
+  void setup(size_t bytes, const char* spillPath = nullptr, size_t spillBytes = 0, unsigned maxLength = 0) {
+    stopSpiller();
+    spill.close();
+
+    capacityInBytes = bytes;
+    slotLength = maxLength;
+    blocks.clear();
+    storage.clear();
+    freeSlots.clear();
+    newest = oldest = -1;
+    count = 0;
+    residentBytes = 0;
+
+    if(spillPath != nullptr && spill.open(spillPath, spillBytes, maxLength) == false)
+      fprintf(stderr, "Error: can't map block cache file %s!\n", spillPath);
+
+    if(spill.isOpen()) {
+      size_t slots = (slotLength > 0) ? capacityInBytes / (slotLength * sizeof(float)) : 0;
+      spillRequests.setup(max<size_t>(slots, 1));
+      spillsDone.setup(max<size_t>(slots, 1));
+
+      spillerRunning = true;
+      spiller = std::thread([this] {
+        while(spillerRunning) {
+          SpillJob job;
+          bool idle = true;
+
+          while(spillRequests.pop(job)) {
+            memcpy(spill.slot(job.spillSlot), slotSamples(job.slot), job.length * sizeof(float));
+            while(spillsDone.push(job) == false) std::this_thread::yield();
+            idle = false;
+          }
+          if(idle) std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+      });
+    }
+  }
+
+  // empties the cache and makes room for blocks of cloudCount clouds, as
+  // many as fit the capacity. Not for the audio thread.
+  void reserve(unsigned cloudCount) {
+    finishSpills();
+
+    blocks.assign(cloudCount, CachedBlock());
+    newest = oldest = -1;
+    count = 0;
+    residentBytes = 0;
+    spill.freeAllSlots();
+
+    size_t slots = (slotLength > 0) ? capacityInBytes / (slotLength * sizeof(float)) : 0;
+    slots = min<size_t>(slots, cloudCount);
+    if(storage.size() != slots * slotLength) {
+      vector<float>().swap(storage);
+      storage.assign(slots * slotLength, 0.0f);
+    }
+
+    freeSlots.clear();
+    freeSlots.reserve(slots);
+    for(int i = slots - 1; i >= 0; i--) freeSlots.push_back(i);
+  }
+
+  CachedBlock* find(unsigned cloud, unsigned band, const BlockSignature& signature) {
+    collectSpills();
+
+    if(cloud >= blocks.size() || blocks[cloud].cached == false
+       || blocks[cloud].band != band || blocks[cloud].signature != signature) {
+      misses++;
+      return nullptr;
+    }
+
+    unlink(cloud);
+    linkNewest(cloud);
+
+    hits++;
+    blocks[cloud].pinned = true;
+    return &blocks[cloud];
+  }
+
+  void release(CachedBlock* block) {
+    if(block != nullptr) block->pinned = false;
+  }
+
+  // samples of a block returned by find(), or nullptr when it is silent
+  const float* samplesOf(CachedBlock* block) {
+    if(block->silent) return nullptr;
+    if(block->slot >= 0) return slotSamples(block->slot);
+    return spill.slot(block->spillSlot);
+  }
+
+  // a free slot of maxLength samples to record a cloud into, for insert()
+  // or abandon(), making room if needed. -1 when every slot is taken.
+  int startRecording() {
+    collectSpills();
+    if(freeSlots.empty()) dropOldest();
+    if(freeSlots.empty()) return -1;
+
+    int slot = freeSlots.back();
+    freeSlots.pop_back();
+    return slot;
+  }
+
+  float* slotSamples(int slot) { return &storage[(size_t)slot * slotLength]; }
+
+  void abandon(int slot) {
+    if(slot >= 0) freeSlots.push_back(slot);
+  }
+
+  // takes over a recording of length samples
+  void insert(unsigned cloud, unsigned band, const BlockSignature& signature, int slot, unsigned length) {
+    if(cloud >= blocks.size() || blocks[cloud].pinned || blocks[cloud].spilling) {
+      abandon(slot);
+      return;
+    }
+    if(blocks[cloud].cached) erase(cloud);
+
+    CachedBlock& b = blocks[cloud];
+    b.band = band;
+    b.signature = signature;
+    b.length = length;
+    b.cached = true;
+
+    const float* samples = slotSamples(slot);
+    b.silent = all_of(samples, samples + length, [](float v) { return v == 0; });
+    b.slot = -1;
+    b.spillSlot = -1;
+
+    if(b.silent) {
+      abandon(slot);
+    } else {
+      b.slot = slot;
+      residentBytes += length * sizeof(float);
+    }
+
+    linkNewest(cloud);
+    count++;
+
+    spillOldest();
+  }
+
+  void invalidateBand(unsigned band) {
+    for(unsigned i = 0; i < blocks.size(); i++)
+      if(blocks[i].cached && blocks[i].band == band && blocks[i].pinned == false) erase(i);
+  }
+
+  void clear() {
+    for(unsigned i = 0; i < blocks.size(); i++)
+      if(blocks[i].cached && blocks[i].pinned == false) erase(i);
+  }
+
+  unsigned size() const { return count; }
+
+ private:
+  void linkNewest(int i) {
+    blocks[i].older = newest;
+    blocks[i].newer = -1;
+    if(newest >= 0) blocks[newest].newer = i;
+    newest = i;
+    if(oldest < 0) oldest = i;
+  }
+
+  void unlink(int i) {
+    CachedBlock& b = blocks[i];
+    if(b.newer >= 0) blocks[b.newer].older = b.older;
+    else newest = b.older;
+    if(b.older >= 0) blocks[b.older].newer = b.newer;
+    else oldest = b.newer;
+    b.newer = b.older = -1;
+  }
+
+  // a block being spilled keeps its slots until the copy is collected
+  void erase(int i) {
+    CachedBlock& b = blocks[i];
+    unlink(i);
+    b.cached = false;
+    count--;
+
+    if(b.slot >= 0) residentBytes -= b.length * sizeof(float);
+    if(b.spilling) return;
+
+    abandon(b.slot);
+    if(b.spillSlot >= 0) spill.freeSlots.push_back(b.spillSlot);
+    b.slot = b.spillSlot = -1;
+  }
+
+  // least recently used block whose slot can be given up
+  int oldestResident() {
+    for(int i = oldest; i >= 0; i = blocks[i].newer)
+      if(blocks[i].slot >= 0 && blocks[i].pinned == false && blocks[i].spilling == false) return i;
+    return -1;
+  }
+
+  void dropOldest() {
+    int i = oldestResident();
+    if(i >= 0) erase(i);
+  }
+
+  // With a spill file, keeps an eighth of the slots free by handing the
+  // oldest resident blocks to the spiller, which frees their slots once
+  // copied. The oldest spilled blocks make way in the file.
+  void spillOldest() {
+    if(spill.isOpen() == false) return;
+
+    size_t wanted = max<size_t>(1, storage.size() / max(1u, slotLength) / 8);
+    while(freeSlots.size() + spillsPending < wanted) {
+      int i = oldestResident();
+      if(i < 0) break;
+
+      if(spill.freeSlots.empty()) {
+        for(int j = oldest; j >= 0; j = blocks[j].newer) {
+          if(blocks[j].spillSlot >= 0 && blocks[j].pinned == false) {
+            erase(j);
+            break;
+          }
+        }
+      }
+      if(spill.freeSlots.empty()) {
+        erase(i);
+        continue;
+      }
+
+      CachedBlock& b = blocks[i];
+      SpillJob job = { i, b.slot, spill.freeSlots.back(), b.length };
+      if(spillRequests.push(job) == false) break;
+
+      spill.freeSlots.pop_back();
+      b.spilling = true;
+      spillsPending++;
+    }
+  }
+
+  // moves blocks whose copy is done to the file, freeing their slots
+  void collectSpills() {
+    SpillJob job;
+    while(spillsPending > 0 && spillsDone.pop(job)) {
+      spillsPending--;
+      CachedBlock& b = blocks[job.block];
+      b.spilling = false;
+      abandon(job.slot);
+
+      if(b.cached) {
+        residentBytes -= b.length * sizeof(float);
+        b.slot = -1;
+        b.spillSlot = job.spillSlot;
+      } else {
+        spill.freeSlots.push_back(job.spillSlot);
+        b.slot = b.spillSlot = -1;
+      }
+    }
+  }
+
+  void finishSpills() {
+    while(spillsPending > 0) {
+      collectSpills();
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+
+  void stopSpiller() {
+    spillerRunning = false;
+    if(spiller.joinable()) spiller.join();
+    spillsPending = 0;
+  }
+};
+
+// Settings of one frequency band, i.e. one column of the dataset
+struct Band {
+  float minMidi = 0, maxMidi = 0;
+  bool mute = false, solo = false;
+};
+
+// One of the datasets an engine plays together, e.g. several users or
+// years compared side by side. It is mixed at its gain, and its bands
+// sound bandOffset bands higher up (lower when negative); bands moved out
+// of range are left out.
+struct Dataset {
+  vector<vector<float>> data; // bandCount use durations per day
+  float gain = 1.0f;
+  int bandOffset = 0;
+
+  // cloud of each day and band the dataset sounds in, day after day, as
+  // an index into Engine::clouds, or noCloud
+  enum : unsigned { noCloud = ~0u };
+  vector<unsigned> cloudIds;
+
+  unsigned days() const { return data.size(); }
+};
+
+// Owns the clouds of the datasets and everything needed to play them
+// back. All settings are plain members; clouds pick up changes at the next
+// block.
+struct Engine {
+  float sampleRate = 44100.0f;
+
+  // A cloud only depends on its band and grain density, so every use of
+  // the same density in the same band, on any day of any dataset, shares
+  // one cloud, built from a seed derived from both. Comparing datasets
+  // thus costs little more than playing one, and so does a year with
+  // recurring days.
+  vector<Dataset> datasets;
+  vector<Cloud*> clouds;
+
+  struct CloudSpec {
+    unsigned day; // first day using it
+    unsigned band;
+    int density;
+  };
+  vector<CloudSpec> cloudSpecs; // of each cloud, in order of first use
+
+  float cloudDuration = 200.0f;
+  unsigned cloudDurationInSamples = 0;
+  float grainDuration = 20.0f;
+
+  unsigned days = 0;
+  unsigned currentPosInSamples = 0;
+  unsigned elapsedDay = 0;
+  
+  // one band per column of the datasets, from 24 hours down to 1440
+  // minutes a day
+  unsigned bandCount = 0;
+  vector<Band> bands;
+
+  // make-up gain for sparse data, see weighVoices()
+  bool normalizeByActiveBands = false;
+
+  int grainWaveFormType = 0;
+  int grainEnvType = 0;
+
+  // grains are scattered from per-cloud seeds derived from this one, so a
+  // given use in a given band always sounds the same
+  unsigned randomSeed = 20170120;
+
+  // rendered clouds are kept once a full cloud has been played, so looping
+  // the same year only synthesizes it the first time around
+  BlockCache blockCache;
+  bool useBlockCache = true;
+  size_t blockCacheBytes = 256 << 20;
+  const char* blockCacheSpillPath = nullptr; // e.g. "final/blockcache.bin"
+  size_t blockCacheSpillBytes = (size_t)1 << 30;
+
+  struct VoicePlayback {
+    CachedBlock* block = nullptr; // block being served, if any
+    int recording = -1;           // cache slot the cloud is recorded into
+    unsigned recorded = 0;        // samples of the cloud recorded so far
+    BlockSignature signature;
+  };
+
+  struct CachedBand {
+    float minMidi = -1, maxMidi = -1; // band the cache holds
+  };
+
+  // optional mode that mixes grains from pre-rendered copies, with grain
+  // frequencies rounded to grainCacheCents
+  GrainCache grainCache;
+  bool useGrainCache = false;
+  float grainCacheCents = 5.0f;
+
+  // sine clouds with at least spectralThreshold grains sounding at once
+  // are rendered with inverse-FFT overlap-add, 0 (the default) turns that
+  // off. It only pays off with grains of a few hundred milliseconds, well
+  // beyond what the interface offers.
+  SpectralBank spectralBank;
+  unsigned spectralThreshold = 0;
+
+  // sounds that grains of the "Sample" waveform are read from
+  SampleCorpus corpus;
+
+  vector<CachedBand> cachedBands;
+  BlockSignature cachedSettings;
+  vector<float> bandBuffer;
+
+  // The clouds of the current day with any use at all, across datasets,
+  // so that bands without data cost nothing. Each is played once and mixed
+  // at the summed weight of the datasets using it.
+  struct Voice {
+    Cloud* cloud;
+    unsigned id; // index in clouds
+    unsigned band;
+    float weight;
+  };
+  struct VoiceUser {
+    unsigned voice, dataset;
+  };
+  vector<Voice> voices;
+  vector<VoiceUser> voiceUsers;
+  vector<VoicePlayback> playback; // of each voice
+  vector<unsigned> voiceOf;       // of each cloud, for today's clouds
+  vector<unsigned> datasetBands;  // of each dataset, with grains today
+  unsigned voicesDay = ~0u;
+  vector<unsigned> activeVoices;  // rendered in the current block
+  float playedCloudDuration = 0;
+
+  // clouds are built on every core, in order of first use. With
+  // backgroundLoading load() returns as soon as day 0 is ready and the
+  // other days follow during playback; dayLoaded() tells which ones are.
+  // Clouds not built yet are nullptr.
+  bool backgroundLoading = false;
+  vector<std::thread> loaders;
+  unique_ptr<atomic<unsigned>[]> cloudsToLoad; // first used per day, 0 once built
+  atomic<unsigned> nextCloudToLoad { 0 };
+  atomic<unsigned> loadedDayCount { 0 }; // days before it are ready
+  atomic<bool> cancelLoad { false };
+  std::mutex loadMutex;
+  std::condition_variable firstDayLoaded;
+
+  // The voices of a block are updated and synthesized by the audio thread
+  // and renderThreads further threads, started by setup(), one per further
+  // core by default. Voices are shared out in chunks, each mixed on its own
+  // and added in order, so the mix doesn't depend on which thread rendered
+  // what. Only plain time-domain synthesis is shared, since the grain cache
+  // and spectral synthesis keep state across clouds.
+  unsigned renderThreads = max(1u, std::thread::hardware_concurrency()) - 1;
+  vector<std::thread> renderers;
+  atomic<bool> renderersRunning { false };
+  atomic<unsigned> renderJob { 0 };         // bumped for every job shared
+  atomic<uint64_t> nextRenderChunk { 0 };   // job << 32 | next chunk
+  atomic<unsigned> renderChunksLeft { 0 };
+  atomic<unsigned> renderChunkCount { 0 };
+
+  // a job runs task over chunks of its items
+  typedef void (Engine::*RenderTask)(unsigned from, unsigned to, unsigned chunk, unsigned thread);
+  RenderTask renderTask = nullptr;
+  unsigned renderItemCount = 0, renderLength = 0;
+  vector<unsigned> synthVoices;             // items of a synthesis job
+  vector<float> chunkMixes;                 // of each chunk
+  vector<float> renderBuffers;              // of each renderer
+
+  Engine() {}
+  Engine(const Engine&) = delete;
+  Engine& operator=(const Engine&) = delete;
+
+  ~Engine() {
+    stopLoading();
+    stopRenderers();
+    for(auto c : clouds) delete c;
+  }
+
+  // maxBlockSize only bounds the scratch buffers, render() takes any length
+  void setup(float rate, unsigned maxBlockSize) {
+    sampleRate = rate;
+    cloudDurationInSamples = (cloudDuration / 1000.0f) * sampleRate;
+    bandBuffer.resize(maxBlockSize);
+    unsigned maxGrainDurationInSamples = (50.0f / 1000.0f) * sampleRate;
+    grainCache.setup(sampleRate, maxGrainDurationInSamples);
+    spectralBank.setup(sampleRate);
+
+    unsigned maxCloudDurationInSamples = (500.0f / 1000.0f) * sampleRate;
+    for(auto& p : playback) detachVoice(p);
+    blockCache.setup(blockCacheBytes, blockCacheSpillPath, blockCacheSpillBytes, maxCloudDurationInSamples);
+    blockCache.reserve(cloudSpecs.size());
+
+    startRenderers(maxBlockSize);
+
+    if(bandCount == 0) setBandCount(24);
+  }
+
+  // lays out n bands evenly between 400 Hz and 10 kHz, with padding that
+  // shrinks with the band count (a semitone between 24 bands)
+  void setBandCount(unsigned n) {
+    for(auto& p : playback) detachVoice(p);
+    blockCache.clear();
+
+    bandCount = n;
+    bands.assign(n, Band());
+    cachedBands.assign(n, CachedBand());
+
+    float minFrequency = 400.0f;
+    float maxFrequency = 10000.0f;
+    
+    float maxMidi = ftom(maxFrequency);
+    float minMidi = ftom(minFrequency);
+  
+    float freqBandPadding = 24.0f / n;
+    float freqBandwidth = (maxMidi - minMidi - freqBandPadding * (n - 1)) / n;
+    
+    for(unsigned i = 0; i < n; i++) {
+      bands[i].minMidi = minMidi + (freqBandwidth + freqBandPadding) * i;
+      bands[i].maxMidi = bands[i].minMidi + freqBandwidth;
+    }
+  }
+
+  // use duration in minutes at which a band reaches 100 grains per second,
+  // i.e. the length of the slice of the day it covers
+  float bandMinutes() const { return 1440.0f / bandCount; }
+
+  // reads lines of "date:v0 v1 ..." with use durations in minutes, one
+  // value per band, e.g. 24 hourly or 1440 per-minute values
+  static bool readData(const char* path, vector<vector<float>>& data) {
+    ifstream file;
+    file.open(path);
+
+    if(file.is_open() == false) return false;
+
+    string line;
+
+    while(getline(file, line)) {
+      size_t colon = line.find(':');
+      if(colon == string::npos) continue;
+
+      // values up to the end of the line or a further field
+      vector<float> hourlyData;
+      const char* p = line.c_str() + colon + 1;
+      char* end;
+      for(float v = strtof(p, &end); end != p; v = strtof(p, &end)) {
+        hourlyData.push_back(v);
+        p = end;
+      }
+
+      data.push_back(std::move(hourlyData));
+    }
+
+    file.close();
+    return true;
+  }
+
+  // use durations are minutes of a day. Negative, larger or non-finite
+  // values would give nonsense grain counts.
+  static bool validData(const vector<vector<float>>& data) {
+    for(auto& row : data)
+      for(float v : row)
+        if(!(v >= 0 && v <= 1440)) return false;
+    return true;
+  }
+
+  // replaces the datasets by the one in a file, see readData()
+  bool load(const char* path) {
+    vector<vector<float>> data;
+    if(readData(path, data) == false) return false;
+
+    return load(data);
+  }
+
+  // fails, keeping the datasets, on data rejected by validData()
+  bool load(const vector<vector<float>>& data) {
+    if(validData(data) == false) return false;
+
+    stopLoading();
+    datasets.clear();
+    return addDataset(data);
+  }
+
+  // adds a dataset to compare with the loaded ones, see Dataset
+  bool addDataset(const char* path, float gain = 1.0f, int bandOffset = 0) {
+    vector<vector<float>> data;
+    if(readData(path, data) == false) return false;
+
+    return addDataset(data, gain, bandOffset);
+  }
+
+  bool addDataset(const vector<vector<float>>& data, float gain = 1.0f, int bandOffset = 0) {
+    if(validData(data) == false) return false;
+
+    stopLoading();
+
+    Dataset set;
+    set.data = data;
+    set.gain = gain;
+    set.bandOffset = bandOffset;
+    datasets.push_back(std::move(set));
+
+    build();
+    return true;
+  }
+
+  // builds the clouds of all datasets and starts playback over
+  void build() {
+    TraceScope scope("load", "datasets", datasets.size());
+
+    stopLoading();
+    for(auto& p : playback) detachVoice(p);
+    voices.clear();
+    voiceUsers.clear();
+
+    for(auto c : clouds) delete c;
+    clouds.clear();
+    cloudSpecs.clear();
+    days = 0;
+    elapsedDay = 0;
+    currentPosInSamples = 0;
+    voicesDay = ~0u;
+    blockCache.clear();
+
+    // the band count follows the data, a preset for the same count keeps
+    // its bands
+    unsigned n = 0;
+    for(auto& set : datasets)
+      for(auto& row : set.data) n = max(n, (unsigned)row.size());
+    if(n > 0 && n != bandCount) setBandCount(n);
+
+    for(auto& set : datasets) {
+      for(auto& row : set.data) row.resize(bandCount);
+      set.cloudIds.assign(set.days() * bandCount, Dataset::noCloud);
+      days = max(days, set.days());
+    }
+    if(days == 0) return;
+
+    // one cloud per band and density in use, numbered in order of first
+    // use, so that building them in that order completes day after day
+    cloudsToLoad.reset(new atomic<unsigned>[days]);
+    unordered_map<uint64_t, unsigned> ids;
+
+    for(unsigned day = 0; day < days; day++) {
+      unsigned firstNew = cloudSpecs.size();
+
+      for(auto& set : datasets) {
+        if(day >= set.days()) continue;
+
+        for(unsigned band = 0; band < bandCount; band++) {
+          int target = (int)band + set.bandOffset;
+          if(target < 0 || target >= (int)bandCount) continue;
+
+          int density = set.data[day][band] * 100.0f / bandMinutes();
+          uint64_t key = ((uint64_t)target << 32) | (uint32_t)density;
+
+          auto it = ids.find(key);
+          if(it == ids.end()) {
+            it = ids.emplace(key, cloudSpecs.size()).first;
+            cloudSpecs.push_back({ day, (unsigned)target, density });
+          }
+          set.cloudIds[day * bandCount + target] = it->second;
+        }
+      }
+
+      cloudsToLoad[day] = cloudSpecs.size() - firstNew;
+    }
+
+    clouds.assign(cloudSpecs.size(), nullptr);
+    blockCache.reserve(cloudSpecs.size());
+
+    // a day has at most one voice per band and dataset, so that finding
+    // them during playback never allocates
+    unsigned maxVoices = bandCount * datasets.size();
+    voices.reserve(maxVoices);
+    voiceUsers.reserve(maxVoices);
+    activeVoices.reserve(maxVoices);
+    playback.resize(max((unsigned)playback.size(), maxVoices));
+    voiceOf.assign(cloudSpecs.size(), ~0u);
+    nextCloudToLoad = 0;
+    loadedDayCount = 0;
+    cancelLoad = false;
+    advanceLoadedDays(); // days without new clouds
+
+    // loaders work from a copy of the settings, which may change meanwhile.
+    // Every cloud has its own seed, so the clouds do not depend on which
+    // thread builds them.
+    unsigned threads = max(1u, std::thread::hardware_concurrency());
+    for(unsigned i = 0; i < threads; i++)
+      loaders.emplace_back(&Engine::loadClouds, this, bands, grainDuration, cloudDuration);
+
+    if(backgroundLoading) {
+      std::unique_lock<std::mutex> lock(loadMutex);
+      firstDayLoaded.wait(lock, [this] { return dayLoaded(0); });
+    } else {
+      waitForLoad();
+    }
+  }
+
+  bool dayLoaded(unsigned day) const {
+    return day < loadedDayCount.load(std::memory_order_acquire);
+  }
+
+  // days loaded so far, all of them before the first one still loading
+  unsigned loadedDays() const { return loadedDayCount; }
+
+  // cloud of a dataset on a day in one of the engine bands, nullptr when
+  // the dataset does not sound there or the day is not loaded yet
+  Cloud* cloudAt(const Dataset& set, unsigned day, unsigned band) const {
+    if(day >= set.days() || dayLoaded(day) == false) return nullptr;
+
+    unsigned id = set.cloudIds[day * bandCount + band];
+    return (id == Dataset::noCloud) ? nullptr : clouds[id];
+  }
+
+  void waitForLoad() {
+    for(auto& t : loaders) t.join();
+    loaders.clear();
+  }
+
+  // calls f with every cloud of the days loaded so far
+  template <typename F>
+  void forEachLoadedCloud(F f) {
+    for(unsigned i = 0; i < clouds.size(); i++)
+      if(dayLoaded(cloudSpecs[i].day)) f(clouds[i]);
+  }
+
+ private:
+  // claims clouds one at a time in order of first use, so that all threads
+  // work on day 0 first
+  void loadClouds(vector<Band> bandSettings, float grainDurationSetting, float cloudDurationSetting) {
+    tracer().registerThread("loader");
+    unsigned count = cloudSpecs.size();
+
+    while(cancelLoad.load(std::memory_order_relaxed) == false) {
+      unsigned i = nextCloudToLoad.fetch_add(1);
+      if(i >= count) break;
+
+      const CloudSpec& spec = cloudSpecs[i];
+      Cloud *cloud = new Cloud;
+      cloud->setGrains(sampleRate, hashBits(randomSeed + spec.band, spec.density), spec.density,
+        bandSettings[spec.band].minMidi, bandSettings[spec.band].maxMidi, grainDurationSetting, cloudDurationSetting);
+      cloud->day = spec.day;
+      cloud->band = spec.band;
+      clouds[i] = cloud;
+
+      if(cloudsToLoad[spec.day].fetch_sub(1) == 1) advanceLoadedDays();
+    }
+  }
+
+  // moves loadedDayCount past every day whose clouds, and those of the days
+  // before it, are built. Loaders finishing days out of order race here, so
+  // the count only moves by compare and swap.
+  void advanceLoadedDays() {
+    unsigned day = loadedDayCount;
+
+    while(day < days && cloudsToLoad[day] == 0) {
+      if(loadedDayCount.compare_exchange_weak(day, day + 1) == false) continue;
+
+      traceInstant("day loaded", "day", day);
+      if(day == 0) {
+        std::lock_guard<std::mutex> lock(loadMutex);
+        firstDayLoaded.notify_all();
+      }
+      day++;
+    }
+  }
+
+  // abandons a load in progress, leaving the days not loaded empty
+  void stopLoading() {
+    cancelLoad = true;
+    waitForLoad();
+  }
+
+ public:
+
+  bool loadPreset(const char* path) {
+    ifstream file;
+    file.open(path);
+    string line;
+    if(file.is_open() == false) return false;
+
+    getline (file,line);
+    setCloudDuration(stof(line));
+
+    getline (file,line);
+    grainDuration = stof(line);
+
+    // one "low high" line per band, as many as the preset was saved with
+    vector<Band> presetBands;
+    while(getline (file,line)) {
+      vector<string> midi = split(line, ' ');
+      if(midi.size() < 2) break;
+
+      presetBands.push_back(Band());
+      presetBands.back().minMidi = stof(midi[0]);
+      presetBands.back().maxMidi = stof(midi[1]);
+    }
+
+    // before any data is loaded the preset decides the band count,
+    // afterwards bands only apply to data with as many bands
+    if(days == 0 && presetBands.size() > 0 && presetBands.size() != bandCount)
+      setBandCount(presetBands.size());
+
+    if(presetBands.size() == bandCount) {
+      for(unsigned i = 0; i < bandCount; i++) {
+        bands[i].minMidi = presetBands[i].minMidi;
+        bands[i].maxMidi = presetBands[i].maxMidi;
+      }
+    }
+
+    grainWaveFormType = stoi(line);
+
+    getline (file,line);
+    grainEnvType = stoi(line);
+
+    file.close();
+    return true;
+  }
+
+  bool savePreset(const char* path) const {
+    ofstream file;
+    file.open(path);
+
+    if(file.is_open() == false) return false;
+
+    file << cloudDuration << endl;
+    file << grainDuration << endl;
+
+    for(auto& band : bands) {
+      file << band.minMidi << " " << band.maxMidi << endl;
+    }
+
+    file << grainWaveFormType << endl;
+    file << grainEnvType << endl;
+
+    file.close();
+    return true;
+  }
+
+  // indexes a WAV file or a directory of them at the engine rate, see
+  // ags_corpus.h. Not to be called while rendering.
+  bool loadCorpus(const char* path) {
+    TraceScope scope("load corpus");
+    return corpus.index(path, sampleRate);
+  }
+
+  void setCloudDuration(float duration) {
+    cloudDuration = duration;
+    cloudDurationInSamples = (cloudDuration / 1000.0f) * sampleRate;
+  }
+
+  // starts playback over from the beginning of a day
+  void seek(unsigned day) {
+    elapsedDay = (days > 0) ? day % days : 0;
+    currentPosInSamples = 0;
+    traceInstant("seek", "day", elapsedDay);
+
+    forEachLoadedCloud([](Cloud* cloud) { cloud->reset(); });
+  }
+
+  void reset() { seek(0); }
+
+  // keeps a cloud in sync with the current settings. Global settings reach
+  // every cloud of a day in the same block, so they are traced for one.
+  void updateCloud(Cloud* cloud, unsigned band, bool traced) {
+
+    if(cloud->cloudDuration != cloudDuration) {
+      if(traced) traceInstant("cloud duration", "ms", cloudDuration);
+      cloud->resetCloudDuration(cloudDuration);
+    }
+    if(cloud->grainDuration != grainDuration) {
+      if(traced) traceInstant("grain duration", "ms", grainDuration);
+      cloud->resetGrainDuration(grainDuration);
+    }
+
+    if(cloud->minMidi != bands[band].minMidi 
+      || cloud->maxMidi != bands[band].maxMidi) {
+      traceInstant("frequency band", "band", band);
+      cloud->resetFrequencyBand(bands[band].minMidi, bands[band].maxMidi);
+    }
+
+    if(cloud->grainWaveFormType != grainWaveFormType) {
+      if(traced) traceInstant("waveform", "type", grainWaveFormType);
+      cloud->selectWaveformType(grainWaveFormType);
+    }
+
+    if(cloud->grainEnvType != grainEnvType) {
+      if(traced) traceInstant("envelope", "type", grainEnvType);
+      cloud->selectEnvelopeType(grainEnvType);
+    }
+
+    GrainCache* cache = useGrainCache ? &grainCache : nullptr;
+    if(cloud->grainCache != cache)
+      cloud->setGrainCache(cache);
+
+    if(cloud->corpus != &corpus || cloud->corpusGeneration != corpus.generation)
+      cloud->setCorpus(&corpus);
+
+    if(cloud->spectralBank != &spectralBank || cloud->spectralThreshold != spectralThreshold)
+      cloud->setSpectralBank(&spectralBank, spectralThreshold);
+  }
+
+  // drops cached blocks that the current day's clouds no longer match. Band
+  // edits only touch their own band, anything else touches every block.
+  void invalidateBlockCache() {
+    if(voices.empty()) return;
+
+    BlockSignature settings = BlockSignature::of(voices[0].cloud);
+    settings.minMidi = settings.maxMidi = 0;
+
+    if(settings != cachedSettings) {
+      blockCache.clear();
+      cachedSettings = settings;
+    }
+
+    for(auto& v : voices) {
+      CachedBand& c = cachedBands[v.band];
+
+      if(v.cloud->minMidi != c.minMidi || v.cloud->maxMidi != c.maxMidi) {
+        blockCache.invalidateBand(v.band);
+        c.minMidi = v.cloud->minMidi;
+        c.maxMidi = v.cloud->maxMidi;
+      }
+    }
+  }
+
+  // collects the clouds of the current day that have any use, in any
+  // dataset, done once a day. A band without use never gets grains,
+  // whatever the settings.
+  void findVoices() {
+    for(auto& v : voices) voiceOf[v.id] = ~0u;
+    voices.clear();
+    voiceUsers.clear();
+
+    for(unsigned d = 0; d < datasets.size(); d++) {
+      const Dataset& set = datasets[d];
+      if(elapsedDay >= set.days()) continue;
+
+      for(unsigned band = 0; band < bandCount; band++) {
+        unsigned id = set.cloudIds[elapsedDay * bandCount + band];
+        if(id == Dataset::noCloud || clouds[id]->grainDensity <= 0) continue;
+
+        if(voiceOf[id] == ~0u) {
+          voiceOf[id] = voices.size();
+          voices.push_back({ clouds[id], id, band, 0.0f });
+        }
+        voiceUsers.push_back({ voiceOf[id], d });
+      }
+    }
+
+    // a new day starts every voice over, see renderVoice()
+    if(playback.size() < voices.size()) playback.resize(voices.size());
+    synthVoices.reserve(voices.size());
+    for(auto& p : playback) detachVoice(p);
+
+    datasetBands.assign(datasets.size(), 0);
+    voicesDay = elapsedDay;
+  }
+
+  // Each dataset's mix is scaled by the band count, so the level follows
+  // how much of the day is in use, and then by its gain. With
+  // normalizeByActiveBands it is scaled by its bands that have grains today
+  // instead, which keeps a sparse 1440-band day audible.
+  void weighVoices() {
+    for(auto& v : voices) v.weight = 0;
+
+    if(normalizeByActiveBands == false) {
+      for(auto& u : voiceUsers) voices[u.voice].weight += datasets[u.dataset].gain / bandCount;
+      return;
+    }
+
+    fill(datasetBands.begin(), datasetBands.end(), 0u);
+    for(auto& u : voiceUsers)
+      if(voices[u.voice].cloud->grains.empty() == false) datasetBands[u.dataset]++;
+
+    for(auto& u : voiceUsers)
+      if(datasetBands[u.dataset] > 0) voices[u.voice].weight += datasets[u.dataset].gain / datasetBands[u.dataset];
+  }
+
+  // adds the next n samples of a voice to out at its weight, either copied
+  // from a cached block or synthesized and recorded for the cache. A silent
+  // voice, with no grain sounding in those samples, is only moved ahead.
+  void renderVoice(unsigned voice, float* out, unsigned n, bool silent) {
+    startVoice(voice);
+    VoicePlayback& p = playback[voice];
+
+    if(silent) {
+      voices[voice].cloud->skipSilence(n);
+      if(p.recording >= 0) record(p, nullptr, n);
+    } else if(p.block != nullptr) {
+      playCachedBlock(voice, out, n);
+    } else {
+      synthesizeVoice(voice, &bandBuffer[0], out, n);
+    }
+
+    finishVoice(voice);
+  }
+
+  // looks a voice up in the cache when its cloud starts over, and drops
+  // what it plays or records when the settings changed since
+  void startVoice(unsigned voice) {
+    const Voice& v = voices[voice];
+    Cloud* cloud = v.cloud;
+    VoicePlayback& p = playback[voice];
+    BlockSignature signature = BlockSignature::of(cloud);
+
+    if(cloud->cloudSampleIndex == 0) {
+      detachVoice(p);
+      p.block = useBlockCache ? blockCache.find(v.id, v.band, signature) : nullptr;
+      if(useBlockCache && p.block == nullptr && cloud->cloudDurationInSamples <= blockCache.slotLength)
+        p.recording = blockCache.startRecording();
+      p.recorded = 0;
+      p.signature = signature;
+    }
+
+    if(signature != p.signature) {
+      // settings changed halfway through the cloud
+      if(p.block != nullptr) cloud->seek(cloud->cloudSampleIndex);
+      detachVoice(p);
+    }
+  }
+
+  void playCachedBlock(unsigned voice, float* out, unsigned n) {
+    const Voice& v = voices[voice];
+    const float* samples = blockCache.samplesOf(playback[voice].block);
+
+    if(samples != nullptr) {
+      samples += v.cloud->cloudSampleIndex;
+      for(unsigned i = 0; i < n; i++) out[i] += v.weight * samples[i];
+    }
+
+    v.cloud->cloudSampleIndex += n;
+  }
+
+  // synthesizes a voice into buffer, records it and mixes it into out
+  void synthesizeVoice(unsigned voice, float* buffer, float* out, unsigned n) {
+    const Voice& v = voices[voice];
+    VoicePlayback& p = playback[voice];
+    v.cloud->render(buffer, n);
+
+    if(p.recording >= 0) record(p, buffer, n);
+
+    for(unsigned i = 0; i < n; i++) out[i] += v.weight * buffer[i];
+  }
+
+  // hands a fully recorded cloud to the cache once it has played
+  void finishVoice(unsigned voice) {
+    const Voice& v = voices[voice];
+    VoicePlayback& p = playback[voice];
+    if(v.cloud->hasNext()) return;
+
+    if(p.recording >= 0 && p.recorded == v.cloud->cloudDurationInSamples) {
+      blockCache.insert(v.id, v.band, p.signature, p.recording, p.recorded);
+      p.recording = -1;
+    }
+    detachVoice(p);
+  }
+
+  // appends n samples, or n zeros without samples, to a voice's recording
+  void record(VoicePlayback& p, const float* samples, unsigned n) {
+    if(p.recorded + n > blockCache.slotLength) {
+      detachVoice(p);
+      return;
+    }
+
+    float* to = blockCache.slotSamples(p.recording) + p.recorded;
+    if(samples != nullptr) memcpy(to, samples, n * sizeof(float));
+    else fill(to, to + n, 0.0f);
+    p.recorded += n;
+  }
+
+  // stops serving a voice from the cache and recording it for the cache
+  void detachVoice(VoicePlayback& p) {
+    blockCache.release(p.block);
+    p.block = nullptr;
+    blockCache.abandon(p.recording);
+    p.recording = -1;
+  }
+
+  // moves a muted voice n samples ahead without synthesizing it. Its cloud
+  // is resynced and stops recording for the cache until the next cloud.
+  void skipVoice(unsigned voice, unsigned n) {
+    Cloud* cloud = voices[voice].cloud;
+    VoicePlayback& p = playback[voice];
+
+    detachVoice(p);
+    p.signature = BlockSignature::of(cloud);
+
+    cloud->skip(n);
+  }
+
+  // e.g. 0 when running an engine per core. Not for the audio thread.
+  void setRenderThreads(unsigned n) {
+    renderThreads = n;
+    startRenderers(bandBuffer.size());
+  }
+
+  // (re)starts the renderers, see renderThreads. Not for the audio thread.
+  void startRenderers(unsigned maxBlockSize) {
+    stopRenderers();
+
+    unsigned threads = renderThreads + 1;
+    renderBuffers.assign((size_t)threads * maxBlockSize, 0.0f);
+    chunkMixes.assign((size_t)renderChunksPerThread * threads * maxBlockSize, 0.0f);
+
+    renderersRunning = true;
+    for(unsigned i = 1; i < threads; i++)
+      renderers.emplace_back(&Engine::runRenderer, this, i);
+  }
+
+  void stopRenderers() {
+    renderersRunning = false;
+    for(auto& t : renderers) t.join();
+    renderers.clear();
+  }
+
+  // Chunks are small enough for a late or preempted renderer to leave its
+  // share to the others.
+  static const unsigned renderChunksPerThread = 4;
+
+  bool sharesRendering() const {
+    return renderers.empty() == false && useGrainCache == false && spectralThreshold == 0
+      && activeVoices.size() > 1;
+  }
+
+  // brings every voice's cloud up to date with the settings, shared with
+  // the renderers since a new grain or cloud duration reschedules them all
+  void updateVoices() {
+    if(renderers.empty() || voices.size() < 2) {
+      updateVoices(0, voices.size(), 0, 0);
+      return;
+    }
+
+    unsigned chunks = min((unsigned)voices.size(), renderChunksPerThread * (unsigned)(renderers.size() + 1));
+    shareJob(&Engine::updateVoices, voices.size(), chunks);
+  }
+
+  void updateVoices(unsigned from, unsigned to, unsigned, unsigned) {
+    for(unsigned i = from; i < to; i++)
+      updateCloud(voices[i].cloud, voices[i].band, i == 0);
+  }
+
+  // renders the active voices with the renderers. Cache bookkeeping stays
+  // on the audio thread, around the synthesis of the voices that need it.
+  void renderSharedVoices(float* out, unsigned n) {
+    synthVoices.clear();
+
+    for(unsigned v : activeVoices) {
+      startVoice(v);
+      VoicePlayback& p = playback[v];
+
+      if(p.block != nullptr) {
+        playCachedBlock(v, out, n);
+        finishVoice(v);
+        continue;
+      }
+
+      // a renderer can't detach a voice whose recording overflows
+      if(p.recording >= 0 && p.recorded + n > blockCache.slotLength) detachVoice(p);
+      synthVoices.push_back(v);
+    }
+
+    unsigned stride = bandBuffer.size();
+    unsigned chunks = min((unsigned)synthVoices.size(), renderChunksPerThread * (unsigned)(renderers.size() + 1));
+    renderLength = n;
+    shareJob(&Engine::synthesizeVoices, synthVoices.size(), chunks);
+
+    for(unsigned c = 0; c < chunks; c++) {
+      const float* mix = &chunkMixes[(size_t)c * stride];
+      for(unsigned i = 0; i < n; i++) out[i] += mix[i];
+    }
+
+    for(unsigned v : synthVoices) finishVoice(v);
+  }
+
+  // mixes a chunk of the voices of a synthesis job into its own buffer
+  void synthesizeVoices(unsigned from, unsigned to, unsigned chunk, unsigned thread) {
+    unsigned stride = bandBuffer.size();
+    float* buffer = &renderBuffers[(size_t)thread * stride];
+    float* mix = &chunkMixes[(size_t)chunk * stride];
+    fill(mix, mix + renderLength, 0.0f);
+
+    for(unsigned i = from; i < to; i++)
+      synthesizeVoice(synthVoices[i], buffer, mix, renderLength);
+  }
+
+  // runs a job on the audio thread and the renderers, and returns once all
+  // its chunks are done
+  void shareJob(RenderTask task, unsigned items, unsigned chunks) {
+    renderTask = task;
+    renderItemCount = items;
+    renderChunkCount.store(chunks, std::memory_order_relaxed);
+    renderChunksLeft.store(chunks, std::memory_order_relaxed);
+
+    unsigned job = renderJob.load(std::memory_order_relaxed) + 1;
+    nextRenderChunk.store((uint64_t)job << 32, std::memory_order_release);
+    renderJob.store(job, std::memory_order_release);
+
+    runChunks(0, job);
+    while(renderChunksLeft.load(std::memory_order_acquire) > 0) std::this_thread::yield();
+  }
+
+  // claims chunks of a job until none is left. The job number in the claim
+  // keeps a renderer that is late for one job off the next.
+  void runChunks(unsigned thread, unsigned job) {
+    uint64_t claim = nextRenderChunk.load(std::memory_order_acquire);
+
+    while((claim >> 32) == job && (uint32_t)claim < renderChunkCount.load(std::memory_order_relaxed)) {
+      if(nextRenderChunk.compare_exchange_weak(claim, claim + 1, std::memory_order_acquire) == false)
+        continue;
+
+      unsigned c = (uint32_t)claim;
+      unsigned chunks = renderChunkCount.load(std::memory_order_relaxed);
+      (this->*renderTask)(c * renderItemCount / chunks, (c + 1) * renderItemCount / chunks, c, thread);
+
+      renderChunksLeft.fetch_sub(1, std::memory_order_release);
+      claim = nextRenderChunk.load(std::memory_order_acquire);
+    }
+  }
+
+  // waits for jobs by yielding for a while after each one and then by
+  // short sleeps, so idle renderers cost little
+  void runRenderer(unsigned thread) {
+    tracer().registerThread("renderer");
+    unsigned seen = renderJob.load(std::memory_order_acquire);
+    unsigned idle = 0;
+
+    while(renderersRunning.load(std::memory_order_relaxed)) {
+      unsigned job = renderJob.load(std::memory_order_acquire);
+
+      if(job != seen) {
+        seen = job;
+        idle = 0;
+        runChunks(thread, job);
+      } else if(++idle < 1000) {
+        std::this_thread::yield();
+      } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+      }
+    }
+  }
+
+  // writes the next frames of the mono mix into out
+  void render(float* out, unsigned frames) {
+    TraceScope scope("engine render", "frames", frames);
+    fill(out, out + frames, 0.0f);
+
+    if(grainCache.cents != grainCacheCents) grainCache.reset(grainCacheCents);
+    grainCache.nextBlock();
+
+    // a new cloud duration restarts the clouds, and with them the day
+    if(playedCloudDuration != cloudDuration) {
+      playedCloudDuration = cloudDuration;
+      currentPosInSamples = 0;
+    }
+
+    unsigned offset = 0;
+    while(days > 0 && offset < frames) {
+
+      // a day still loading in the background plays as silence
+      if(dayLoaded(elapsedDay) == false) break;
+
+      if(voicesDay != elapsedDay) findVoices();
+
+      updateVoices();
+      weighVoices();
+      invalidateBlockCache();
+
+      // every cloud of a day shares the same duration and position
+      unsigned n = min(frames - offset, cloudDurationInSamples - min(currentPosInSamples, cloudDurationInSamples));
+      n = min(n, (unsigned)bandBuffer.size());
+
+      // clouds shorter than a sample, or no setup(), can't move ahead
+      if(n == 0) break;
+
+      activeVoices.clear();
+      for(unsigned v = 0; v < voices.size(); v++) {
+        if(bands[voices[v].band].mute || voices[v].weight == 0) skipVoice(v, n);
+        else if(voices[v].cloud->soundsWithin(n)) activeVoices.push_back(v);
+        else renderVoice(v, out + offset, n, true);
+      }
+      traceCounter("active clouds", activeVoices.size());
+
+      if(sharesRendering()) {
+        renderSharedVoices(out + offset, n);
+      } else {
+        for(unsigned v : activeVoices)
+          renderVoice(v, out + offset, n, false);
+      }
+
+      offset += n;
+      currentPosInSamples += n;
+
+      if(currentPosInSamples >= cloudDurationInSamples) {
+        for(auto& v : voices)
+          v.cloud->reset();
+
+        traceInstant("clouds reset", "day", elapsedDay);
+        elapsedDay++;
+        currentPosInSamples = 0;
+        
+        if(elapsedDay == days) {
+          elapsedDay = 0;  
+        }
+      }
+    }
+  }
+};
+
+} // namespace ags
+
+#endif
@@ -0,0 +1,129 @@
+/* C interface of the headless AGS synthesis engine.
+
+   Renders the granular sonification of a dataset into caller buffers
+   without any windowing or audio device code, e.g. for batch pipelines:
+
+     ags_engine* e = ags_engine_create(44100.0f, 512);
+     ags_engine_load_file(e, "hourlyLength.txt");
+     ags_engine_render(e, buffer, frames);
+     ags_engine_destroy(e);
+
+   An engine must only be used by one thread at a time; separate engines
+   are independent. Functions returning int return 0 on success and -1 on
+   failure. */
+
+#ifndef AGS_ENGINE_C_H
+#define AGS_ENGINE_C_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ags_engine ags_engine;
+
+enum {
+  AGS_WAVEFORM_SINE = 0,
+  AGS_WAVEFORM_SAW = 1,
+  AGS_WAVEFORM_TRIANGLE = 2,
+  AGS_WAVEFORM_SQUARE = 3,
+  AGS_WAVEFORM_IMPULSE = 4,
+  AGS_WAVEFORM_SAMPLE = 5 /* windows of the corpus sounds */
+};
+
+enum {
+  AGS_ENVELOPE_ATTACK_DECAY = 0,
+  AGS_ENVELOPE_HANN = 1
+};
+
+ags_engine* ags_engine_create(float sample_rate, unsigned max_block_size);
+void ags_engine_destroy(ags_engine* engine);
+
+/* Loads "date:v0 v1 ..." lines of use durations in minutes, one value per
+   band: 24 hourly values, 1440 per-minute values or anything in between.
+   A band is fully dense when its whole slice of the day is used. Replaces
+   any datasets loaded before. Clouds are built on all cores, and this and
+   ags_engine_load_data return once every day is ready. Values must lie
+   between 0 and 1440 minutes; data with any other value, including NaN,
+   is rejected and leaves the loaded datasets as they were. */
+int ags_engine_load_file(ags_engine* engine, const char* path);
+
+/* Loads days * bands values, one day after another. The band count of the
+   engine follows bands. */
+int ags_engine_load_data(ags_engine* engine, const float* values, unsigned days, unsigned bands);
+
+/* Adds a dataset, read or laid out like the ones above, to be played
+   along with those loaded so far, e.g. to compare users or years. Its mix
+   is scaled by gain and its bands sound band_offset bands higher (lower
+   when negative); bands moved out of range are left out. The same use in
+   the same band shares one cloud across days and datasets. */
+int ags_engine_add_file(ags_engine* engine, const char* path, float gain, int band_offset);
+int ags_engine_add_data(ags_engine* engine, const float* values, unsigned days, unsigned bands,
+                        float gain, int band_offset);
+int ags_engine_set_dataset_gain(ags_engine* engine, unsigned dataset, float gain);
+unsigned ags_engine_dataset_count(const ags_engine* engine);
+
+/* Maps a WAV file, or every WAV file of a directory, as the corpus that
+   AGS_WAVEFORM_SAMPLE grains read from. 16-bit and float PCM at the engine
+   rate are read in place, anything else is converted once into a
+   <file>.<rate>.f32 copy beside it. */
+int ags_engine_load_corpus(ags_engine* engine, const char* path);
+
+/* Reads or writes a setting file as saved by the interface. */
+int ags_engine_load_preset(ags_engine* engine, const char* path);
+int ags_engine_save_preset(const ags_engine* engine, const char* path);
+
+/* Takes effect at the next load. */
+void ags_engine_set_seed(ags_engine* engine, unsigned seed);
+
+/* Clouds last 100 to 500 ms and grains 10 to 50 ms, as in the interface.
+   Other durations are rejected. */
+int ags_engine_set_cloud_duration(ags_engine* engine, float milliseconds);
+int ags_engine_set_grain_duration(ags_engine* engine, float milliseconds);
+int ags_engine_set_band(ags_engine* engine, unsigned band, float midi_low, float midi_high);
+int ags_engine_set_mute(ags_engine* engine, unsigned band, int mute);
+int ags_engine_set_waveform(ags_engine* engine, int waveform);
+int ags_engine_set_envelope(ags_engine* engine, int envelope);
+void ags_engine_set_block_cache(ags_engine* engine, int enabled);
+
+/* Divides the mix by the bands with grains that day instead of the band
+   count, so that sparse per-minute data stays audible. The level then no
+   longer follows how much of the day is in use. Off by default. */
+void ags_engine_set_active_band_gain(ags_engine* engine, int enabled);
+
+/* Mixes grains from cached copies, with grain frequencies rounded to the
+   given number of cents. Much cheaper on dense days, at the cost of that
+   frequency rounding. A copy is rendered as its grain first plays, so
+   turning this on or editing bands costs no more than synthesis. */
+void ags_engine_set_grain_cache(ags_engine* engine, int enabled, float cents);
+
+/* Renders sine clouds with inverse-FFT overlap-add while at least the
+   given number of grains sound at once, within -35 dB of time-domain
+   synthesis. 0, the default, always synthesizes in the time domain. */
+void ags_engine_set_spectral_threshold(ags_engine* engine, unsigned grains);
+
+/* Synthesizes the bands of each block on this many threads besides the
+   one calling ags_engine_render, one per further core by default. Set it
+   to 0 when running an engine per core. */
+int ags_engine_set_render_threads(ags_engine* engine, unsigned threads);
+
+/* Moves playback to the start of a day. */
+int ags_engine_set_day(ags_engine* engine, unsigned day);
+unsigned ags_engine_day(const ags_engine* engine);
+unsigned ags_engine_days(const ags_engine* engine);
+unsigned ags_engine_band_count(const ags_engine* engine);
+
+/* Writes the next frames of the mono mix into out. */
+void ags_engine_render(ags_engine* engine, float* out, unsigned frames);
+
+/* Records render calls, grain starts, cloud resets and setting changes of
+   every engine into a Chrome trace JSON file (chrome://tracing or
+   ui.perfetto.dev) until ags_trace_stop. Recording is safe on real-time
+   threads; starting and stopping are not. */
+int ags_trace_start(const char* path);
+void ags_trace_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
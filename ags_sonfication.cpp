@@ -12,11 +12,13 @@
 // - Cloud frequency bands: 24 bands that represents hours of a day
 //    e.g.) 0 to 1 → 1st band, 1 to 2 → 2nd band, …, 23 to 0 → 24th band
 //    each band has high and low boundaries as a midi note value.
+//    Finer data gets one band per column, up to 1440 bands of a minute.
 // - Cloud duration: a value between 100ms to 500ms
 // - Grain density: hourly use duration rescaled up to 100 grains per second
 // - Grain duration: a value between 10ms to 50ms
 // - Amplitude envelope type: linear ADSR or bell-shaped Gaussian curve (hann window)
-// - Waveform of a grain: a synthetic type among sine, saw, square, triangle, and impulse
+// - Waveform of a grain: a synthetic type among sine, saw, square, triangle, and impulse,
+//    or windows of recorded sounds from the WAV files in final/corpus
 
 // Author: Sihwa Park (sihwapark@ucsb.edu)
 // 2018-03-20
@@ -41,531 +43,88 @@
 #include "AudioPlatform/FFT.h"
 #include "AudioPlatform/Synths.h"
 #include "AudioPlatform/SoundDisplay.h"
-#include <set>
-#include <fstream>
-#include <sstream>
-#include <time.h>
+#include "ags_engine.h"
 
 using namespace ap;
 using namespace std;
 
-#define NUM_GRAINS (100)
-
-template <typename Out>
-void split(const string& s, char delim, Out result) {
-  stringstream ss(s);
-  string item;
-  while(getline(ss, item, delim)) {
-    *(result++) = item;
-  }
-}
-
-vector<string> split(const string& s, char delim) {
-  vector<string> elems;
-  split(s, delim, back_inserter(elems));
-  return elems;
-}
-
-
-Array hannWindow;
-
-
-struct Grain {
-
-  float grainDuration; // milliseconds
-  unsigned grainDurationInSamples; // milliseconds
-  float frequency;
-  float frequnecyRatio;
-  float minFrequency, maxFrequency;
-
-  Sine sine = Sine(4096);
-  MultiSynth synth;
-
-  Line attack, decay;
-  int state;
-  float startTimeRatio;
-  
-  int waveFormType = 0;
-  int envlopeType = 1;
-  unsigned currentPosInSamples = 0;
-
-  Grain(float s, float minFreq, float maxFreq, float freqRatio, float duration) {
-    frequnecyRatio = freqRatio;
-    minFrequency = minFreq;
-    maxFrequency = maxFreq;
-    frequency = minFrequency + freqRatio * (maxFrequency - minFrequency);
-
-    grainDuration = duration;
-    grainDurationInSamples = (duration / 1000.0f) * 44100.0f;
-
-    startTimeRatio = s;
-
-    sine.frequency(frequency);
-    synth.frequency(frequency);
-
-    reset();
-  }
-  void selectEnvelopeType(int t) {
-    envlopeType = t;
-
-    switch(waveFormType) {
-        case 0:
-
-          break;
-        case 1: // saw
-          synth.type = waveFormType - 1;
-          break;
-        default:
-          break;
-    }
-  }
-
-  void selectWaveformType(int t) {
-    waveFormType = t;
-  }
-
-  float operator()() { return nextValue(); }
-
-  float nextValue() {
-    switch(state) {
-    case 0:
-      if(attack.done()) state = 1;
-      break;
-    case 1:
-      if(decay.done()) state = 2;
-      break;
-    case 2:
-      break;
-    default:
-      break;
-    }
-
-    float v = 0;
-    if(hasNext()) {
-      switch(waveFormType) {
-        case 0:
-          v = sine();
-          break;
-        case 1: // saw
-        case 2: // triangle;
-        case 3: // square;
-        case 4: // impulse;
-          v = synth();
-          break;
-        default:
-          break;
-      }
-      
-      float e = 0;
-      if(state == 0) e = attack();
-      else if(state == 1) e = decay();
-
-      float i = hannWindow.size * currentPosInSamples / (float)grainDurationInSamples;
-      v *= (envlopeType == 0) ? e : hannWindow.get(i);
-
-      //v *= e;
-
-      currentPosInSamples++;
-    }
-
-    return v;
-  }
-
-  float hasNext() {
-    return (currentPosInSamples < grainDurationInSamples);
-  }
-
-  void reset() {
-    state = 0;
-    attack.set(0, 1.0, grainDuration / 2.0);
-    decay.set(1.0, 0, grainDuration / 2.0);
-    currentPosInSamples = 0;
-  }
-
-  void resetDuation(float duration) {
-    grainDuration = duration;
-
-    reset();
-  }
-
-  void resetFrequencyBand(float minFreq, float maxFreq) {
-    minFrequency = minFreq;
-    maxFrequency = maxFreq;
-    frequency = minFrequency + frequnecyRatio * (maxFrequency - minFrequency);
-
-    sine.frequency(frequency);
-    synth.frequency(frequency);
-  }
-
-};
-
-struct Cloud {
-  vector<Grain*> grains;
-
-  std::set<Grain*> playList;
-
-  unsigned hopSize;
-  float minFrequency;
-  float maxFrequency;
-  float minMidi;
-  float maxMidi;
-
-  float grainDensity;
-  float grainDuration; // milliseconds
-  float cloudDuration; // milliseconds
-  
-  float increment;
-  float time;
-  unsigned grainIndex = 0;
-  unsigned cloudSampleIndex;
-  unsigned cloudDurationInSamples;
-  int grainWaveFormType = 0;
-  int grainEnvType = 0;
-
-  void reset() {
-    playList.clear();
-    
-    for(auto g : grains) {
-      g->reset();
-      //playList.insert(g);
-    }
-    grainIndex = 0;
-    // time = 0;
-    // grainTimer = 0;
-    cloudSampleIndex = 0;
-
-  }
-  
-  bool hasNext() {
-    return (cloudSampleIndex < cloudDurationInSamples);
-  }
-
-  void setGrains(float density, float midiLow, float midiHigh, float gDuration, float duration) {
-    // as a cumulus cloud, grains are randomly scattered whithin a given frequency band
-    minMidi = midiLow;
-    maxMidi = midiHigh;
-    minFrequency = mtof(minMidi);
-    maxFrequency = mtof(maxMidi);
-    grainDensity = density;
-    cloudDuration = duration;
-    unsigned grainSize = grainDensity * (duration / 1000.0f);
-    grainDuration = gDuration;
-
-    
-    cloudDurationInSamples = (duration / 1000.0f) * 44100.0f;
-    cloudSampleIndex = 0;
-    
-    float maxStartTimeRatio = (cloudDuration - grainDuration) / cloudDuration;
-
-    for(unsigned i = 0; i < grainSize; i++) {
-      float freqRatio = (rand() / (double)RAND_MAX);
-      float startTimeRatio = (rand() / (double)RAND_MAX) * maxStartTimeRatio;
-
-      grains.push_back(new Grain(startTimeRatio, minFrequency, maxFrequency, freqRatio, grainDuration));
-    }
-
-    sort(grains.begin(), grains.end(), [](const Grain* a, const Grain* b) {
-      return a->startTimeRatio < b->startTimeRatio;
-    });
-    
-  }
-  
-  void selectWaveformType(int type) {
-    grainWaveFormType = type;
-
-    for(auto g : grains)
-      g->selectWaveformType(grainWaveFormType);
-  }
-
-  void selectEnvelopeType(int type) {
-    grainEnvType = type;
-
-    for(auto g : grains)
-      g->selectEnvelopeType(grainEnvType); 
-  }
-
-  void resetFrequencyBand(float midiLow, float midiHigh) {
-    minMidi = midiLow;
-    maxMidi = midiHigh;
-    minFrequency = mtof(minMidi);
-    maxFrequency = mtof(maxMidi);
-
-    for(auto g : grains)
-      g->resetFrequencyBand(minFrequency, maxFrequency);
-  }
-
-  void resetCloudDuration(float duration) {
-    //printf("grainSize: %d\n", grains.size());
-
-    cloudDuration = duration;
-    unsigned grainSize = grainDensity * (duration / 1000.0f);
-
-    cloudDurationInSamples = (duration / 1000.0f) * 44100.0f;
-
-    if(cloudSampleIndex > cloudDurationInSamples)
-      cloudSampleIndex = cloudDurationInSamples;
-
-    int diff = grainSize - grains.size();
-    
-    if(diff < 0) {
-      if(grainIndex > grainSize) grainIndex = 0;
-      
-      grains.erase(grains.end() + diff, grains.end());
-
-    } else if(diff > 0) {
-      float lastValue = (grains.size() > 0) ? (grains[grains.size() - 1])->startTimeRatio : 0;
-      float maxStartTimeRatio = (cloudDuration - grainDuration) / cloudDuration;
-
-      for(int i = 0; i < diff; i++) {
-        float freqRatio = (rand() / (double)RAND_MAX);
-        
-        float startTimeRatio = lastValue + (maxStartTimeRatio - lastValue) * (rand() / (double)RAND_MAX);
-        grains.push_back(new Grain(startTimeRatio, minFrequency, maxFrequency, freqRatio, grainDuration));
-      }
-
-      sort(grains.end() - diff, grains.end(), [](const Grain* a, const Grain* b) {
-        return a->startTimeRatio < b->startTimeRatio;
-      });
-    }  
-
-    reset();
-  }
-
-  void resetGrainDuration(float duration) {
-    grainDuration = duration;
-
-    for(auto g : grains)
-      g->resetDuation(grainDuration);
-  }
-
-  float operator()() { return nextValue(); }
-  
-  float nextValue() {
-    
-    //time += increment;
-    
-    // if(time >= cloudDuration / 1000.0f) {
-    //   time = cloudDuration / 1000.0f;
-    //   // cloud duration expired
-    // }
-    if(grainIndex < grains.size() && cloudSampleIndex >= grains[grainIndex]->startTimeRatio * cloudDurationInSamples) {
-      playList.insert(grains[grainIndex]);
-      grainIndex++;
-    }
-    
-    // grainTimer += grainTimerInc;
-    // if(grainTimer >= 1) {
-    //   grainTimer = 0;
-
-    //   if(grainIndex < grains.size()) {
-    //     playList.insert(grains[grainIndex]);
-    //     grainIndex++;
-    //   }
-    // }
-
-    float v = 0;
-    set<Grain*> shouldRemove;
-
-    int count = 0;
-    for(auto g : playList) {
-      if (g->hasNext()) {
-        v += g->nextValue();
-        count++;
-      }
-      else
-        shouldRemove.insert(g);
-    }
-
-    if(count > 0) v /= (float)count;
-
-    for(auto g : shouldRemove) playList.erase(g);
-
-
-    cloudSampleIndex++;
-
-    if(cloudSampleIndex >= cloudDurationInSamples)
-      cloudSampleIndex = cloudDurationInSamples;
-    
-    return v;
-  }
-};
-
 ImVec2 addVectors(ImVec2 &a, ImVec2 &b) {
   return ImVec2(a.x + b.x, a.y + b.y);
 }
 
 struct App : AudioVisual {
   
-  SamplePlayer player;
   Line gain;
   
   SoundDisplay display;
-  vector<Cloud*> clouds;
-  vector<vector<float>> allData;
+
+  // all synthesis lives in the engine, the app only draws and controls it
+  ags::Engine engine;
 
   float midiLimit = ftom(sampleRate * 0.5);
 
   bool play = false;
 
-  float cloudDuration = 200.0f;
-  unsigned cloudDurationInSamples = (cloudDuration / 1000.0f) * 44100.0f;
-  float grainDuration = 20.0f;
-
-  unsigned days = 0;
-  unsigned currentPosInSamples = 0;
-  unsigned elapsedDay = 0;
-  
-  float freqBands[24][2];
-  bool mute[24], solo[24];
-  int grainWaveFormType = 0;
-  int grainEnvType = 0;
+  vector<float> mix;
 
   void setup() {
     
     display.setup(4 * blockSize);
-    hann(hannWindow, 4096);
-
-    float minFrequency = 400.0f;
-    float maxFrequency = 10000.0f;
-    
-    float maxMidi = ftom(maxFrequency);
-    float minMidi = ftom(minFrequency);
-  
-    float freqBandPadding = 1;
-    float freqBandwidth = (maxMidi - minMidi - freqBandPadding * 23.0f) / 24.0f;
-    
-    for(unsigned i = 0; i < 24; i++) {
-      mute[i] = solo[i] = false;
 
-      float midiLow = minMidi + (freqBandwidth + freqBandPadding) * i;
-      float midiHigh =  midiLow + freqBandwidth;
+    mix.resize(blockSize);
 
-      freqBands[i][0] = midiLow;
-      freqBands[i][1] = midiHigh;
+    // AGS_TRACE=trace.json records a Chrome trace of the session
+    const char* tracePath = getenv("AGS_TRACE");
+    if(tracePath != nullptr && ags::tracer().start(tracePath) == false) {
+      printf("Error: can't open %s!\n", tracePath);
     }
+    ags::tracer().registerThread("ui");
+
+    engine.setup(sampleRate, blockSize);
 
     loadPreset();
 
-    ifstream file;
-    file.open("final/hourlyLength.txt");
+    if(engine.loadCorpus("final/corpus") == false) {
+      printf("Error: no sounds in final/corpus, sample grains will be silent!\n");
+    }
 
-    if(file.is_open() == false) {
-      printf("Error: can't open final/hourlyLength.txt file!\n");
+    // playback can start once day 0 is built, the rest loads meanwhile
+    engine.backgroundLoading = true;
+    if(engine.load("final/hourlyLength.txt") == false) {
+      printf("Error: can't read final/hourlyLength.txt file!\n");
       exit(1);
     }
 
-    string line;
-    srand(time(NULL));
-
-    while(getline(file, line)) {
-      vector<string> data = split(line, ':');
-      unsigned freqBandIndex = 0;
-      vector<float> hourlyData;
-
-      for(auto& s : split(data[1], ' ')) {
-        float useLength = stof(s);
-        float grainDensity = useLength * 100.0f / 60.0f;
-
-        Cloud *cloud = new Cloud;
-        cloud->setGrains((int)grainDensity, 
-          freqBands[freqBandIndex][0], freqBands[freqBandIndex][1], grainDuration, cloudDuration);
+    // AGS_COMPARE=other.txt:third.txt@2 plays more datasets along with it,
+    // each optionally moved up by a number of bands
+    const char* compare = getenv("AGS_COMPARE");
+    if(compare != nullptr) {
+      for(auto& entry : ags::split(compare, ':')) {
+        vector<string> fields = ags::split(entry, '@');
+        int offset = (fields.size() > 1) ? atoi(fields[1].c_str()) : 0;
 
-        freqBandIndex++;
-        clouds.push_back(cloud);
-        hourlyData.push_back(useLength);  
+        if(engine.addDataset(fields[0].c_str(), 1.0f, offset) == false) {
+          printf("Error: can't read %s!\n", fields[0].c_str());
+        }
       }
-
-      allData.push_back(hourlyData);
-
-      days++;
     }
-
-    file.close();
   }
 
   void loadPreset() {
-    ifstream file;
-    file.open("final/setting.txt");
-    string line;
-    if(file.is_open() == false) {
+    if(engine.loadPreset("final/setting.txt") == false) {
       printf("Error: setting.txt does not exist!\n");
-    } else {
-
-      getline (file,line);
-      cloudDuration = stof(line);
-
-      cloudDurationInSamples = (cloudDuration / 1000.0f) * 44100.0f;
-
-      getline (file,line);
-      grainDuration = stof(line);
-
-      for(int i = 0; i < 24; i++) {
-        getline (file,line);
-        
-        vector<string> midi = split(line, ' ');
-        freqBands[i][0] = stof(midi[0]);
-        freqBands[i][1] = stof(midi[1]);
-      }
-
-      getline (file,line);
-      grainWaveFormType = stoi(line);
-
-      getline (file,line);
-      grainEnvType = stoi(line);
-
-      file.close();
-    }      
+    }
   }
+
   void audio(float* out) {
+    ags::tracer().registerThread("audio");
+    ags::TraceScope scope("audio callback");
     
-    for (unsigned i = 0; i < blockSize * channelCount; i += channelCount) {
-      float f = 0;
-      
-      if(play == true && clouds.size() > 0) {
-        
-        bool dayDone = true;
-        for(unsigned j = elapsedDay * 24; j < (elapsedDay + 1) * 24; j++) {
-          unsigned hour = j - elapsedDay * 24;
-
-          if(clouds[j]->cloudDuration != cloudDuration) 
-            clouds[j]->resetCloudDuration(cloudDuration);
-          if(clouds[j]->grainDuration != grainDuration) 
-            clouds[j]->resetGrainDuration(grainDuration);
-
-          if(clouds[j]->minMidi != freqBands[hour][0] 
-            || clouds[j]->maxMidi != freqBands[hour][1]) {
-            clouds[j]->resetFrequencyBand(freqBands[hour][0], freqBands[hour][1]);
-          }
-
-          if(clouds[j]->grainWaveFormType != grainWaveFormType)
-            clouds[j]->selectWaveformType(grainWaveFormType);
-
-          if(clouds[j]->grainEnvType != grainEnvType)
-            clouds[j]->selectEnvelopeType(grainEnvType);
-
-          float v = clouds[j]->nextValue();
-          f += (mute[hour])? 0 : v; 
-
-          bool hasNext = clouds[j]->hasNext();
-          if(!hasNext) {
-            clouds[j]->reset();
-            //clouds[j]->resetCloudDuration(cloudDuration);
-          } 
-          dayDone &= !hasNext;
-        }
+    if(play == true) engine.render(&mix[0], blockSize);
+    else fill(mix.begin(), mix.end(), 0.0f);
 
-        f /= (float)24;
-        currentPosInSamples++;
-
-        if(dayDone) {
-          printf("day %d done\n", elapsedDay);
-          elapsedDay++;
-          
-          if(elapsedDay == 365) {
-            elapsedDay = 0;  
-          }
-        }
-      }
+    for (unsigned i = 0, k = 0; i < blockSize * channelCount; i += channelCount, k++) {
+      float f = mix[k];
 
       out[i + 1] = out[i + 0] = f * gain();
       
@@ -575,6 +134,7 @@ struct App : AudioVisual {
   }
 
   void visual() {
+    ags::TraceScope scope("visual");
     {
       int windowWidth, windowHeight;
       glfwGetWindowSize(window, &windowWidth, &windowHeight);
@@ -588,6 +148,7 @@ struct App : AudioVisual {
 
       ImGui::Columns(2, NULL, false);
       static int zoom = 1;
+      static int heatmapDataset = 0;
       static unsigned lastDay = 0;
 
       ImGui::Text("Grain Spectrogram");
@@ -614,11 +175,22 @@ struct App : AudioVisual {
       drawList->AddLine(ImVec2(canvas_pos_top_left.x, canvas_pos_bottom_right.y), canvas_pos_bottom_right, ImColor(255, 255, 255));
       
       float unitDayWidth = floor(canvas_size.x / (365.0 / (zoom + 1)));
-      float ratio = currentPosInSamples / (float)(cloudDurationInSamples);
-      //printf("day: %d, samples: %d, %f\n", elapsedDay, currentPosInSamples, ratio);
+      float ratio = engine.currentPosInSamples / (float)(engine.cloudDurationInSamples);
+      //printf("day: %d, samples: %d, %f\n", engine.elapsedDay, engine.currentPosInSamples, ratio);
+
+      // days scrolled out of view, or not loaded yet, are only spaced out
+      float viewStartX = ImGui::GetScrollX();
+      auto dayVisible = [&](unsigned i) {
+        return (i + 1) * unitDayWidth >= viewStartX && i * unitDayWidth <= viewStartX + canvas_size.x;
+      };
 
-      for(unsigned i = 0; i < days; i++) {
+      for(unsigned i = 0; i < engine.days; i++) {
         ImGui::SameLine();
+        if(dayVisible(i) == false || engine.dayLoaded(i) == false) {
+          ImGui::Dummy(ImVec2(unitDayWidth, canvas_size.y - 20));
+          continue;
+        }
+
         ImGui::BeginChild(ImGui::GetID((void*)(intptr_t)i), ImVec2(unitDayWidth, canvas_size.y - 20), false);
         ImVec2 pos_top_left = ImGui::GetCursorScreenPos();
         ImVec2 size = ImGui::GetContentRegionAvail();
@@ -627,16 +199,28 @@ struct App : AudioVisual {
         ImDrawList* draw_list2 = ImGui::GetWindowDrawList();
         draw_list2->AddRect(pos_top_left, pos_bottom_right, ImColor(200, 200, 200, 10));
         
-        for(unsigned j = i * 24; j < (i + 1) * 24; j++) {
-          
-          for(auto g: clouds[j]->grains) {
-            
-            float y = pos_bottom_right.y - (g->frequency / (sampleRate * 0.5)) * size.y;
-            
-            float xStart = pos_top_left.x + g->startTimeRatio * size.x;
-            float xEnd = xStart + (g->grainDuration / clouds[j]->cloudDuration) * size.x;
-
-            draw_list2->AddLine(ImVec2(xStart, y), ImVec2(xEnd, y), ImColor(255, 0, 0));          
+        // one color per dataset, clouds shared between datasets are drawn
+        // in the color of the last one
+        static const ImColor datasetColors[] = {
+          ImColor(255, 0, 0), ImColor(0, 160, 255), ImColor(0, 220, 90), ImColor(255, 200, 0)
+        };
+
+        for(unsigned d = 0; d < engine.datasets.size(); d++) {
+          ImColor color = datasetColors[d % IM_ARRAYSIZE(datasetColors)];
+
+          for(unsigned band = 0; band < engine.bandCount; band++) {
+            ags::Cloud* cloud = engine.cloudAt(engine.datasets[d], i, band);
+            if(cloud == nullptr) continue;
+
+            for(auto g: cloud->grains) {
+              
+              float y = pos_bottom_right.y - (cloud->frequencyOf(g) / (sampleRate * 0.5)) * size.y;
+              
+              float xStart = pos_top_left.x + cloud->startTimeRatioOf(g) * size.x;
+              float xEnd = xStart + (cloud->grainDuration / cloud->cloudDuration) * size.x;
+
+              draw_list2->AddLine(ImVec2(xStart, y), ImVec2(xEnd, y), color);          
+            }
           }
         }
 
@@ -655,7 +239,7 @@ struct App : AudioVisual {
         ImGui::SetScrollX(page * canvas_size.x);
       } 
 
-      if(play && elapsedDay == 0) {
+      if(play && engine.elapsedDay == 0) {
         ImGui::SetScrollX(0);
       }
 
@@ -663,7 +247,7 @@ struct App : AudioVisual {
 
       ImGui::EndChild();
       
-      ImGui::Text("Hourly Heatmap Data Visualization");
+      ImGui::Text("Heatmap Data Visualization");
       ImGui::BeginChild("Heatmap", canvas_size, true, ImGuiWindowFlags_NoScrollbar);
       ImVec2 heatmap_pos_top_left = ImGui::GetCursorScreenPos();
       ImVec2 heatmap_size = ImGui::GetContentRegionAvail();
@@ -673,9 +257,18 @@ struct App : AudioVisual {
 
       heatmapDrawList->AddRectFilled(heatmap_pos_top_left, heatmap_pos_bottom_right, ImGui::GetColorU32(ImGuiCol_FrameBg));
 
-      for(unsigned i = 0; i < days; i++) {
+      // the heatmap shows one dataset at a time
+      heatmapDataset = min(heatmapDataset, (int)engine.datasets.size() - 1);
+      const ags::Dataset& shownDataset = engine.datasets[heatmapDataset];
+
+      for(unsigned i = 0; i < engine.days; i++) {
         ImGui::SameLine();
-        ImGui::BeginChild(ImGui::GetID((void*)(intptr_t)(i + days)), ImVec2(unitDayWidth, heatmap_size.y - 0), false);
+        if(dayVisible(i) == false || i >= shownDataset.days()) {
+          ImGui::Dummy(ImVec2(unitDayWidth, heatmap_size.y - 0));
+          continue;
+        }
+
+        ImGui::BeginChild(ImGui::GetID((void*)(intptr_t)(i + engine.days)), ImVec2(unitDayWidth, heatmap_size.y - 0), false);
         ImVec2 pos_top_left = ImGui::GetCursorScreenPos();
         ImVec2 size = ImGui::GetContentRegionAvail();
         ImVec2 pos_bottom_right = addVectors(pos_top_left, size);
@@ -683,17 +276,25 @@ struct App : AudioVisual {
         ImDrawList* draw_list2 = ImGui::GetWindowDrawList();
         draw_list2->AddRect(pos_top_left, pos_bottom_right, ImColor(200, 200, 200, 10));
         
-        ImVec2 rect_size = ImVec2(size.x, size.y / 24.0f);
-        vector<float> day = allData[i];
+        // bands thinner than a pixel are averaged into one row
+        unsigned rows = max(1u, min(engine.bandCount, (unsigned)size.y));
+        ImVec2 rect_size = ImVec2(size.x, size.y / rows);
+        const vector<float>& day = shownDataset.data[i];
 
         
-        for(int j = 0; j < 24; j++) {
+        for(unsigned j = 0; j < rows; j++) {
+          unsigned first = j * engine.bandCount / rows;
+          unsigned last = (j + 1) * engine.bandCount / rows;
+
+          float use = 0;
+          for(unsigned k = first; k < last; k++) use += day[k];
+          use /= (last - first) * engine.bandMinutes();
 
-          ImVec2 rect_top_left = ImVec2(pos_top_left.x, pos_top_left.y + (1 - (j + 1) / 24.0f) * size.y);
+          ImVec2 rect_top_left = ImVec2(pos_top_left.x, pos_top_left.y + (1 - (j + 1) / (float)rows) * size.y);
           ImVec2 rect_bottom_right = addVectors(rect_top_left, rect_size);
-          int r = 244 * day[j] / 60.0;
-          int g = 200 * day[j] / 60.0;
-          int b = 10 * day[j] / 60.0;;
+          int r = 244 * use;
+          int g = 200 * use;
+          int b = 10 * use;
           int a = 255;
           draw_list2->AddRectFilled(rect_top_left, rect_bottom_right, ImColor(r, g, b, a));
         }
@@ -726,36 +327,14 @@ struct App : AudioVisual {
       ImGui::SameLine();
       if (ImGui::Button("Stop")) {
         play = false;
-        elapsedDay = 0;
         lastDay = 0;
-        currentPosInSamples = 0;
-
-        for(auto cloud: clouds) {
-          cloud->reset();
-        }
+        engine.reset();
       } 
 
       ImGui::SameLine();
       if (ImGui::Button("Save")) {
-        ofstream file;
-        file.open("final/setting.txt");
-
-        if(file.is_open() == false) {
+        if(engine.savePreset("final/setting.txt") == false) {
           printf("Error: can't open file!\n");
-        } else {
-
-          
-          file << cloudDuration << endl;
-          file << grainDuration << endl;
-
-          for(int i = 0 ; i < 24; i++) {
-            file << freqBands[i][0] << " " << freqBands[i][1] << endl;
-          }
-
-          file << grainWaveFormType << endl;
-          file << grainEnvType << endl;
-
-          file.close();
         }
       }
 
@@ -767,6 +346,13 @@ struct App : AudioVisual {
       ImGui::SameLine();
       ImGui::PushItemWidth(canvas_size.x * 0.55);     
       ImGui::SliderInt("Zoom", &zoom, 1, 100);
+
+      if(engine.loadedDays() < engine.days) {
+        char progress[64];
+        snprintf(progress, sizeof(progress), "loading %u / %u days", engine.loadedDays(), engine.days);
+        ImGui::SameLine();
+        ImGui::ProgressBar(engine.loadedDays() / (float)engine.days, ImVec2(-1, 0), progress);
+      }
       
       ImGui::NextColumn();
       
@@ -775,42 +361,55 @@ struct App : AudioVisual {
 
       const ImVec2 slider_size(20, canvas_size.y * 0.5 - 10);
 
-      ImGui::Text("Hourly Frequecy Bands (midi note)");
-      for(int i = 0; i < 24; i++) {
+      ImGui::Text("Frequecy Bands (midi note)");
+
+      // only the bands scrolled into view get controls, so 1440 minute
+      // bands cost as much to draw as 24 hourly ones
+      const float bandWidth = slider_size.x + 2.0f;
+      int bandCount = engine.bandCount;
+      ImGui::BeginChild("Bands", ImVec2(0, slider_size.y * 2 + 70), false, ImGuiWindowFlags_HorizontalScrollbar);
+
+      int firstBand = min(bandCount, (int)(ImGui::GetScrollX() / bandWidth));
+      int lastBand = min(bandCount, firstBand + (int)(ImGui::GetWindowWidth() / bandWidth) + 2);
+
+      if(firstBand > 0) ImGui::Dummy(ImVec2(firstBand * bandWidth - 2.0f, 1));
+
+      for(int i = firstBand; i < lastBand; i++) {
         if (i > 0) ImGui::SameLine();
 
         ImGui::BeginGroup();
         ImGui::PushID(i * 2);
         
-        ImGui::VSliderFloat("##v", slider_size, &freqBands[i][1], 0, midiLimit, "");
+        ags::Band& band = engine.bands[i];
+        ImGui::VSliderFloat("##v", slider_size, &band.maxMidi, 0, midiLimit, "");
 
-        if(freqBands[i][1]  <= freqBands[i][0] + 1)
-          freqBands[i][1] = freqBands[i][0] + 1;
+        if(band.maxMidi  <= band.minMidi + 1)
+          band.maxMidi = band.minMidi + 1;
 
         if (ImGui::IsItemActive() || ImGui::IsItemHovered())
-                        ImGui::SetTooltip("%d High\n%.2f", i, freqBands[i][1]);
+                        ImGui::SetTooltip("%d High\n%.2f", i, band.maxMidi);
         ImGui::PopID();
 
 
         ImGui::PushID(i * 2 + 1);
         
-        ImGui::VSliderFloat("##v", slider_size, &freqBands[i][0], 0, midiLimit, "");
+        ImGui::VSliderFloat("##v", slider_size, &band.minMidi, 0, midiLimit, "");
         
-        if(freqBands[i][0]  >= freqBands[i][1] - 1)
-          freqBands[i][0] = freqBands[i][1] - 1;
+        if(band.minMidi  >= band.maxMidi - 1)
+          band.minMidi = band.maxMidi - 1;
 
         if (ImGui::IsItemActive() || ImGui::IsItemHovered())
-                        ImGui::SetTooltip("%d Low\n%.2f", i, freqBands[i][0]);
+                        ImGui::SetTooltip("%d Low\n%.2f", i, band.minMidi);
 
         ImGui::PopID();
 
         ImGui::PushID(i);
-        ImGui::PushStyleColor(ImGuiCol_Button, (mute[i])? (ImVec4)ImColor(255, 0, 0, 40) : (ImVec4)ImColor(125, 125, 125, 40));
-        ImGui::PushStyleColor(ImGuiCol_ButtonHovered, (mute[i])? (ImVec4)ImColor(255, 0, 0, 125) : (ImVec4)ImColor(125, 125, 125, 125));
-        ImGui::PushStyleColor(ImGuiCol_ButtonActive, (mute[i])? (ImVec4)ImColor(255, 0, 0, 255) : (ImVec4)ImColor(125, 125, 125, 255));
+        ImGui::PushStyleColor(ImGuiCol_Button, (band.mute)? (ImVec4)ImColor(255, 0, 0, 40) : (ImVec4)ImColor(125, 125, 125, 40));
+        ImGui::PushStyleColor(ImGuiCol_ButtonHovered, (band.mute)? (ImVec4)ImColor(255, 0, 0, 125) : (ImVec4)ImColor(125, 125, 125, 125));
+        ImGui::PushStyleColor(ImGuiCol_ButtonActive, (band.mute)? (ImVec4)ImColor(255, 0, 0, 255) : (ImVec4)ImColor(125, 125, 125, 255));
         
         if(ImGui::Button("M ")) {
-          mute[i] = !mute[i];
+          band.mute = !band.mute;
         }
         ImGui::PopStyleColor(3);
         ImGui::PopID();
@@ -820,14 +419,14 @@ struct App : AudioVisual {
         ImGui::PushStyleColor(ImGuiCol_ButtonHovered, (ImVec4)ImColor(0, 255, 0, 125));
         ImGui::PushStyleColor(ImGuiCol_ButtonActive, (ImVec4)ImColor(0, 255, 0, 255));
         if(ImGui::Button("S ")) {
-          solo[i] = !solo[i];
+          band.solo = !band.solo;
 
-          for(int j = 0; j < 24; j++) {
-            mute[j] = solo[i];
-            if(i != j) solo[j] = false;
+          for(int j = 0; j < bandCount; j++) {
+            engine.bands[j].mute = band.solo;
+            if(i != j) engine.bands[j].solo = false;
           }
 
-          if(solo[i]) mute[i] = !solo[i];
+          if(band.solo) band.mute = !band.solo;
         }
         ImGui::PopStyleColor(3);
         ImGui::PopID();
@@ -835,6 +434,13 @@ struct App : AudioVisual {
         ImGui::EndGroup();
       }
 
+      if(lastBand < bandCount) {
+        ImGui::SameLine();
+        ImGui::Dummy(ImVec2((bandCount - lastBand) * bandWidth, 1));
+      }
+
+      ImGui::EndChild();
+
       ImGui::PopStyleVar();
       ImGui::PopStyleVar();
       
@@ -863,54 +469,81 @@ struct App : AudioVisual {
       ImGui::SliderFloat("Level (dB)", &db, -60.0f, 3.0f);
       gain.set(dbtoa(db), 50.0f);
 
-      float lastDuration = cloudDuration;
+      // compared datasets, see AGS_COMPARE
+      if(engine.datasets.size() > 1) {
+        for(unsigned d = 0; d < engine.datasets.size(); d++) {
+          char label[32];
+          snprintf(label, sizeof(label), "Dataset %u Gain", d + 1);
+          ImGui::SliderFloat(label, &engine.datasets[d].gain, 0.0f, 2.0f);
+        }
+        int shown = heatmapDataset + 1;
+        ImGui::SliderInt("Heatmap Dataset", &shown, 1, engine.datasets.size());
+        heatmapDataset = shown - 1;
+      }
+
+      float lastDuration = engine.cloudDuration;
       ImGui::SliderFloat("Cloud Duration", &lastDuration, 100, 500);
-      if(lastDuration != cloudDuration) {
+      if(lastDuration != engine.cloudDuration) {
         
-        cloudDuration = lastDuration;
-        cloudDurationInSamples = (cloudDuration / 1000.0f) * 44100.0f;
+        engine.setCloudDuration(lastDuration);
 
         if(play == false)
-          for(auto c : clouds)
-            c->resetCloudDuration(cloudDuration);
+          engine.forEachLoadedCloud([&](ags::Cloud* c) { c->resetCloudDuration(engine.cloudDuration); });
       }
 
-      lastDuration = grainDuration;
+      lastDuration = engine.grainDuration;
       ImGui::SliderFloat("Grain Duration", &lastDuration, 10, 50);
-      if(lastDuration != grainDuration) {
+      if(lastDuration != engine.grainDuration) {
         
-        grainDuration = lastDuration;
+        engine.grainDuration = lastDuration;
 
         if(play == false)
-          for(auto c : clouds)
-            c->resetGrainDuration(grainDuration);
+          engine.forEachLoadedCloud([&](ags::Cloud* c) { c->resetGrainDuration(engine.grainDuration); });
       }
 
-      static const char* types[] = { "Sine", "Saw", "Traingle", "Square", "Impulse" };
+      static const char* types[] = { "Sine", "Saw", "Traingle", "Square", "Impulse", "Sample" };
       
-      int lastType = grainWaveFormType;
+      int lastType = engine.grainWaveFormType;
       ImGui::Combo("Grain Waveform", &lastType, types, IM_ARRAYSIZE(types));   // Combo using proper array. You can also pass a callback to retrieve array value, no need to create/copy an array just for that.
       
-      if(lastType != grainWaveFormType) {
-        grainWaveFormType = lastType;
+      if(lastType != engine.grainWaveFormType) {
+        engine.grainWaveFormType = lastType;
 
         if(play == false)
-          for(auto c : clouds)
-            c->selectWaveformType(grainWaveFormType);
+          engine.forEachLoadedCloud([&](ags::Cloud* c) { c->selectWaveformType(engine.grainWaveFormType); });
       }
 
       static const char* envTypes[] = { "Attack-Decay", "Hann Window" };
       
-      int lastEnvType = grainEnvType;
+      int lastEnvType = engine.grainEnvType;
       ImGui::Combo("Grain Envelope", &lastEnvType, envTypes, IM_ARRAYSIZE(envTypes));   // Combo using proper array. You can also pass a callback to retrieve array value, no need to create/copy an array just for that.
       
-      if(lastEnvType != grainEnvType) {
-        grainEnvType = lastEnvType;
+      if(lastEnvType != engine.grainEnvType) {
+        engine.grainEnvType = lastEnvType;
 
         if(play == false)
-          for(auto c : clouds)
-            c->selectEnvelopeType(grainEnvType);
+          engine.forEachLoadedCloud([&](ags::Cloud* c) { c->selectEnvelopeType(engine.grainEnvType); });
       }
+      ImGui::Checkbox("Grain Cache", &engine.useGrainCache);
+      ImGui::SameLine();
+      ImGui::PushItemWidth(canvas_size.x * 0.3);
+      ImGui::SliderFloat("Resolution (cents)", &engine.grainCacheCents, 1, 50);
+      ImGui::PopItemWidth();
+
+      int threshold = engine.spectralThreshold;
+      ImGui::PushItemWidth(canvas_size.x * 0.3);
+      ImGui::SliderInt("Spectral Synthesis Above (grains, 0 = off)", &threshold, 0, 64);
+      ImGui::PopItemWidth();
+      engine.spectralThreshold = threshold;
+
+      ImGui::Checkbox("Block Cache", &engine.useBlockCache);
+      ImGui::SameLine();
+      ImGui::Text("%u blocks, %.1f MB, %u hits / %u misses", engine.blockCache.size(),
+        engine.blockCache.residentBytes / (1024.0f * 1024.0f), engine.blockCache.hits, engine.blockCache.misses);
+
+      // louder sparse days, at the cost of level following use
+      ImGui::Checkbox("Gain by Active Bands", &engine.normalizeByActiveBands);
+
       // if (ImGui::IsItemHovered() && lastType == 0) {
       //     ImGui::BeginTooltip();
       //     ImGui::Text("I am a fancy tooltip");
@@ -923,9 +556,10 @@ struct App : AudioVisual {
       //ImGui::ShowTestWindow();
       
       
-      if(elapsedDay != lastDay) {
-        lastDay = elapsedDay;
-        currentPosInSamples = 0;
+      // reported from here rather than the audio thread
+      if(engine.elapsedDay != lastDay) {
+        printf("day %d done\n", lastDay);
+        lastDay = engine.elapsedDay;
       }
       
 
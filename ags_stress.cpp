@@ -0,0 +1,219 @@
+// Real-time deadline stress test of the AGS synthesis engine.
+
+// Feeds the engine a worst-case dataset (every hour of every day saturated
+// at 60 minutes) with the longest clouds and grains, and moves the controls
+// while it plays. Every configuration of block size and sample rate is run
+// through the same block path as App::audio, and the time of each callback
+// is reported as a percentage of its deadline (blockSize / sampleRate).
+// Callbacks are timed by the CPU time of the calling thread, which leaves
+// out the time a shared machine deschedules the test, as it would not an
+// audio thread of real-time priority. Callbacks that only went over their
+// deadline that way are counted as stalled. The exit status is non-zero
+// when a configuration goes over budget twice in a row.
+
+// Usage: ags_stress [--seconds s] [--p99-budget percent]
+//                   [--max-budget percent] [--cache] [--grain-cache]
+//                   [--spectral grains] [--bands n] [--rate hz]
+//                   [--block samples] [--trace trace.json]
+
+// Copyright (C) 2018 Sihwa Park
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "ags_engine.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+
+using namespace std;
+
+struct Result {
+  float p50, p99, max;
+  unsigned stalled;
+};
+
+// CPU time of the calling thread, in seconds
+double threadTime() {
+  timespec t;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// moves one of the controls the way the interface would between callbacks
+void changeSetting(ags::Engine& engine, mt19937& rng, unsigned callback) {
+  unsigned band = rng() % engine.bandCount;
+
+  switch(callback % 5) {
+    case 0: {
+      float low = 60 + (rng() % 4800) / 100.0f;
+      engine.bands[band].minMidi = low;
+      engine.bands[band].maxMidi = low + 1 + (rng() % 1200) / 100.0f;
+      break;
+    }
+    case 1:
+      engine.grainDuration = (engine.grainDuration == 50.0f) ? 49.0f : 50.0f;
+      break;
+    case 2:
+      engine.grainWaveFormType = (engine.grainWaveFormType + 1) % 5;
+      break;
+    case 3:
+      engine.grainEnvType = 1 - engine.grainEnvType;
+      break;
+    case 4:
+      engine.setCloudDuration((engine.cloudDuration == 500.0f) ? 499.0f : 500.0f);
+      break;
+  }
+}
+
+Result run(float sampleRate, unsigned blockSize, float seconds, bool useBlockCache, bool useGrainCache, unsigned spectralThreshold, unsigned bandCount) {
+  ags::Engine engine;
+  engine.useBlockCache = useBlockCache;
+  engine.useGrainCache = useGrainCache;
+  engine.spectralThreshold = spectralThreshold;
+  engine.setup(sampleRate, blockSize);
+  engine.setCloudDuration(500.0f);
+  engine.grainDuration = 50.0f;
+
+  // every band saturated, i.e. its whole slice of the day in use
+  vector<vector<float>> data(8, vector<float>(bandCount, 1440.0f / bandCount));
+  engine.load(data);
+
+  unsigned channelCount = 2;
+  vector<float> mix(blockSize), out(blockSize * channelCount);
+
+  unsigned callbacks = max(1u, (unsigned)(seconds * sampleRate / blockSize));
+  unsigned changeInterval = max(1u, (unsigned)(0.25f * sampleRate / blockSize));
+  double deadline = blockSize / (double)sampleRate;
+
+  vector<float> load;
+  load.reserve(callbacks);
+  mt19937 rng(blockSize + (unsigned)sampleRate);
+  unsigned stalled = 0;
+
+  // first block builds the shared tables
+  engine.render(&mix[0], blockSize);
+
+  for(unsigned c = 0; c < callbacks; c++) {
+    if(c % changeInterval == changeInterval / 2)
+      changeSetting(engine, rng, c / changeInterval);
+
+    auto start = chrono::steady_clock::now();
+    double startTime = threadTime();
+    ags::TraceScope scope("callback", "rate block", sampleRate, blockSize);
+
+    // same work as App::audio
+    engine.render(&mix[0], blockSize);
+    for(unsigned i = 0, k = 0; i < blockSize * channelCount; i += channelCount, k++)
+      out[i + 1] = out[i + 0] = mix[k];
+
+    double busy = threadTime() - startTime;
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    if(elapsed.count() > deadline && busy <= deadline) stalled++;
+    load.push_back(100.0 * busy / deadline);
+  }
+
+  sort(load.begin(), load.end());
+
+  Result r;
+  r.p50 = load[load.size() / 2];
+  r.p99 = load[min(load.size() - 1, (size_t)(load.size() * 0.99))];
+  r.max = load.back();
+  r.stalled = stalled;
+  return r;
+}
+
+int main(int argc, char* argv[]) {
+  float seconds = 4.0f;
+  float p99Budget = 50.0f;
+  float maxBudget = 100.0f;
+  bool useBlockCache = false;
+  bool useGrainCache = false;
+  unsigned spectralThreshold = 0;
+  unsigned bandCount = 24;
+  float onlyRate = 0;
+  unsigned onlyBlock = 0;
+  const char* tracePath = nullptr;
+  bool usage = false;
+
+  for(int i = 1; i < argc; i++) {
+    if(strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) seconds = atof(argv[++i]);
+    else if(strcmp(argv[i], "--p99-budget") == 0 && i + 1 < argc) p99Budget = atof(argv[++i]);
+    else if(strcmp(argv[i], "--max-budget") == 0 && i + 1 < argc) maxBudget = atof(argv[++i]);
+    else if(strcmp(argv[i], "--cache") == 0) useBlockCache = true;
+    else if(strcmp(argv[i], "--grain-cache") == 0) useGrainCache = true;
+    else if(strcmp(argv[i], "--spectral") == 0 && i + 1 < argc) spectralThreshold = atoi(argv[++i]);
+    else if(strcmp(argv[i], "--bands") == 0 && i + 1 < argc) bandCount = max(1, atoi(argv[++i]));
+    else if(strcmp(argv[i], "--rate") == 0 && i + 1 < argc) onlyRate = atof(argv[++i]);
+    else if(strcmp(argv[i], "--block") == 0 && i + 1 < argc) onlyBlock = atoi(argv[++i]);
+    else if(strcmp(argv[i], "--trace") == 0 && i + 1 < argc) tracePath = argv[++i];
+    else usage = true;
+  }
+
+  const float sampleRates[] = { 44100.0f, 48000.0f, 96000.0f };
+  const unsigned blockSizes[] = { 64, 128, 256, 512, 1024 };
+
+  // --rate and --block pick one of the configurations above
+  if(onlyRate != 0 && find(begin(sampleRates), end(sampleRates), onlyRate) == end(sampleRates)) usage = true;
+  if(onlyBlock != 0 && find(begin(blockSizes), end(blockSizes), onlyBlock) == end(blockSizes)) usage = true;
+  if(!(seconds > 0.0f) || !isfinite(seconds)) usage = true;
+
+  if(usage) {
+    fprintf(stderr, "usage: %s [--seconds s] [--p99-budget percent] [--max-budget percent] [--cache] [--grain-cache] [--spectral grains] [--bands n] [--rate 44100|48000|96000] [--block 64|128|256|512|1024] [--trace trace.json]\n", argv[0]);
+    return 2;
+  }
+
+  if(tracePath != nullptr) {
+    if(ags::tracer().start(tracePath) == false) {
+      fprintf(stderr, "Error: can't open %s!\n", tracePath);
+      return 2;
+    }
+    ags::tracer().registerThread("stress");
+  }
+
+  printf("%8s %6s %8s %8s %8s %8s\n", "rate", "block", "p50 %", "p99 %", "max %", "stalled");
+
+  int violations = 0;
+  for(float sampleRate : sampleRates) {
+    if(onlyRate != 0 && sampleRate != onlyRate) continue;
+
+    for(unsigned blockSize : blockSizes) {
+      if(onlyBlock != 0 && blockSize != onlyBlock) continue;
+
+      Result r = run(sampleRate, blockSize, seconds, useBlockCache, useGrainCache, spectralThreshold, bandCount);
+      bool over = (r.p99 > p99Budget || r.max > maxBudget);
+
+      // a configuration over budget is run again before it counts, so that
+      // one callback preempted by the system doesn't fail the test
+      bool rerun = over;
+      if(rerun) {
+        r = run(sampleRate, blockSize, seconds, useBlockCache, useGrainCache, spectralThreshold, bandCount);
+        over = (r.p99 > p99Budget || r.max > maxBudget);
+      }
+
+      printf("%8.0f %6u %8.1f %8.1f %8.1f %8u%s%s\n", sampleRate, blockSize, r.p50, r.p99, r.max, r.stalled,
+        rerun ? "  rerun" : "", over ? "  over budget" : "");
+      if(over) violations++;
+    }
+  }
+
+  ags::tracer().stop();
+
+  if(violations > 0) {
+    printf("%d configurations over budget (p99 %.0f%%, max %.0f%%)\n", violations, p99Budget, maxBudget);
+    return 1;
+  }
+
+  return 0;
+}
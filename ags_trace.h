@@ -0,0 +1,359 @@
+// Real-time-safe event tracing of the AGS sonification interface.
+
+// Threads write fixed-size binary events into their own lock-free ring
+// buffers, claimed from a pool allocated when tracing first starts and
+// handed back when the thread exits, so tracing from the audio callback
+// never allocates, locks or touches a file. A background thread drains the
+// rings into Chrome trace JSON that can be opened in chrome://tracing or
+// https://ui.perfetto.dev:
+//
+//   ags::tracer().start("trace.json");
+//   ags::tracer().registerThread("audio"); // names the thread, optional
+//   ags::TraceScope scope("audio callback");
+//   ags::traceInstant("grain start", "day band", day, band);
+//   ags::tracer().stop();
+//
+// Event and argument names must be string literals, since only their
+// addresses are recorded. When tracing is off every call is a single
+// relaxed atomic load. Events that do not fit a full ring are dropped and
+// counted rather than waited for, and so are events of threads beyond the
+// Tracer::maxThreads that can hold a ring at once. start() and stop()
+// themselves allocate and do file I/O, so they belong to the interface or
+// setup code.
+
+// Copyright (C) 2018 Sihwa Park
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef AGS_TRACE_H
+#define AGS_TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+namespace ags {
+
+struct TraceEvent {
+  uint64_t time;        // nanoseconds since tracing started
+  const char* name;     // string literal, the thread name for 'M'
+  const char* argNames; // space separated literal for args, or nullptr
+  int32_t args[2];
+  float value;          // counter value
+  uint16_t thread;      // trace id of the recording thread
+  char phase;           // 'B'egin, 'E'nd, 'i'nstant, 'C'ounter or 'M'etadata
+};
+
+// single producer (the owning thread), single consumer (the drainer)
+struct TraceRing {
+  std::vector<TraceEvent> events; // power of two, never reallocated
+  std::atomic<uint64_t> head { 0 }, tail { 0 };
+  std::atomic<uint64_t> dropped { 0 };
+  std::atomic<bool> owned { false };
+
+  // owner, so that a new trace can name it before it records anything
+  std::atomic<unsigned> threadId { 0 };
+  std::atomic<const char*> threadName { nullptr };
+
+  void push(const TraceEvent& e) {
+    uint64_t h = head.load(std::memory_order_relaxed);
+    if(h - tail.load(std::memory_order_acquire) >= events.size()) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+
+    events[h & (events.size() - 1)] = e;
+    head.store(h + 1, std::memory_order_release);
+  }
+};
+
+struct Tracer;
+
+// the ring a thread holds, if any, given back to the pool when the thread
+// exits so that short-lived threads such as loaders can trace too
+struct TraceThread {
+  Tracer* tracer = nullptr;
+  TraceRing* ring = nullptr;
+  uint16_t id = 0;
+  const char* name = nullptr;
+
+  ~TraceThread();
+};
+
+struct Tracer {
+  static const unsigned maxThreads = 16;
+
+  std::atomic<bool> enabled { false };
+  TraceRing rings[maxThreads];
+  std::atomic<bool> allocated { false }; // rings, by the first start()
+  std::atomic<unsigned> nextThreadId { 1 };
+
+  // steady clock time of start() in nanoseconds, read by recording threads
+  std::atomic<int64_t> startTime { 0 };
+  std::thread drainer;
+  std::atomic<bool> draining { false };
+  FILE* file = nullptr;
+  bool firstEvent = true;
+  std::atomic<uint64_t> unclaimed { 0 }; // events of threads without a ring
+
+  Tracer() {}
+  Tracer(const Tracer&) = delete;
+  Tracer& operator=(const Tracer&) = delete;
+
+  ~Tracer() { stop(); }
+
+  // starts writing a trace to path. The first start() makes room for
+  // eventsPerThread events per thread between two drains; later ones keep
+  // those rings, since threads still recording a stopped trace may write
+  // into them at any time.
+  bool start(const char* path, unsigned eventsPerThread = 1 << 15) {
+    stop();
+
+    file = fopen(path, "w");
+    if(file == nullptr) return false;
+
+    if(allocated == false) {
+      unsigned size = 1;
+      while(size < eventsPerThread) size *= 2;
+      for(auto& r : rings) r.events.assign(size, TraceEvent());
+      allocated.store(true, std::memory_order_release);
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    firstEvent = true;
+
+    // leftovers of the previous trace are skipped rather than rewound, as
+    // their owners may still be pushing
+    for(auto& r : rings) {
+      r.tail.store(r.head.load(std::memory_order_acquire), std::memory_order_release);
+      r.dropped = 0;
+
+      const char* name = r.threadName.load(std::memory_order_acquire);
+      if(r.owned.load(std::memory_order_acquire) && name != nullptr) {
+        TraceEvent e = TraceEvent();
+        e.name = name;
+        e.thread = r.threadId.load(std::memory_order_relaxed);
+        e.phase = 'M';
+        write(e);
+      }
+    }
+    unclaimed = 0;
+
+    startTime = now();
+    draining = true;
+    drainer = std::thread([this] {
+      while(draining) {
+        drain();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+    });
+
+    enabled = true;
+    return true;
+  }
+
+  // flushes every event recorded so far and closes the trace
+  void stop() {
+    if(file == nullptr) return;
+
+    enabled = false;
+    draining = false;
+    if(drainer.joinable()) drainer.join();
+    drain();
+
+    uint64_t dropped = unclaimed;
+    for(auto& r : rings) dropped += r.dropped;
+    if(dropped > 0) fprintf(stderr, "trace: %llu events dropped\n", (unsigned long long)dropped);
+
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    file = nullptr;
+  }
+
+  // names the calling thread in this trace and the ones after it
+  void registerThread(const char* name) {
+    TraceThread& t = thread();
+    t.name = name;
+    if(enabled.load(std::memory_order_relaxed) == false) return;
+
+    if(t.ring != nullptr) nameRing(t);
+    else claim(t);
+  }
+
+  void record(char phase, const char* name, const char* argNames, int32_t a, int32_t b, float value) {
+    TraceThread& t = thread();
+    if(t.ring == nullptr && claim(t) == false) {
+      unclaimed.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+
+    TraceEvent e;
+    e.time = now() - startTime.load(std::memory_order_relaxed);
+    e.name = name;
+    e.argNames = argNames;
+    e.args[0] = a;
+    e.args[1] = b;
+    e.value = value;
+    e.thread = t.id;
+    e.phase = phase;
+    t.ring->push(e);
+  }
+
+  // called by TraceThread when its thread exits
+  void release(TraceThread& t) {
+    if(t.ring == nullptr) return;
+
+    t.ring->threadName.store(nullptr, std::memory_order_relaxed);
+    t.ring->owned.store(false, std::memory_order_release);
+    t.ring = nullptr;
+  }
+
+ private:
+  static int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  TraceThread& thread() {
+    static thread_local TraceThread t;
+    return t;
+  }
+
+  // takes a free ring for the calling thread, under a new id so that the
+  // events its last owner left in it keep theirs
+  bool claim(TraceThread& t) {
+    if(allocated.load(std::memory_order_acquire) == false) return false;
+
+    for(auto& r : rings) {
+      if(r.owned.load(std::memory_order_relaxed)) continue;
+      if(r.owned.exchange(true, std::memory_order_acquire)) continue;
+
+      t.tracer = this;
+      t.ring = &r;
+      t.id = nextThreadId.fetch_add(1, std::memory_order_relaxed);
+      r.threadId.store(t.id, std::memory_order_relaxed);
+      nameRing(t);
+      return true;
+    }
+    return false;
+  }
+
+  void nameRing(TraceThread& t) {
+    if(t.name == nullptr) return;
+
+    t.ring->threadName.store(t.name, std::memory_order_release);
+    record('M', t.name, nullptr, 0, 0, 0);
+  }
+
+  // only called by the drainer, or after it has been joined
+  void drain() {
+    for(auto& r : rings) {
+      uint64_t h = r.head.load(std::memory_order_acquire);
+      uint64_t t = r.tail.load(std::memory_order_relaxed);
+
+      for(; t < h; t++) write(r.events[t & (r.events.size() - 1)]);
+      r.tail.store(t, std::memory_order_release);
+    }
+
+    fflush(file);
+  }
+
+  void separate() {
+    if(firstEvent == false) fprintf(file, ",\n");
+    firstEvent = false;
+  }
+
+  void write(const TraceEvent& e) {
+    separate();
+    if(e.phase == 'M') {
+      fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+        (unsigned)e.thread, e.name);
+      return;
+    }
+
+    fprintf(file, "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%u",
+      e.name, e.phase, e.time / 1000.0, (unsigned)e.thread);
+
+    if(e.phase == 'i') fprintf(file, ",\"s\":\"t\"");
+
+    if(e.phase == 'C') {
+      fprintf(file, ",\"args\":{\"value\":%g}", e.value);
+    } else if(e.argNames != nullptr) {
+      // argument names are split at spaces, e.g. "day band"
+      fprintf(file, ",\"args\":{");
+      const char* n = e.argNames;
+      for(unsigned k = 0; k < 2 && *n != '\0'; k++) {
+        size_t length = strcspn(n, " ");
+        fprintf(file, "%s\"%.*s\":%d", (k > 0) ? "," : "", (int)length, n, e.args[k]);
+        n += length;
+        while(*n == ' ') n++;
+      }
+      fprintf(file, "}");
+    }
+
+    fprintf(file, "}");
+  }
+};
+
+inline Tracer& tracer() {
+  static Tracer t;
+  return t;
+}
+
+inline TraceThread::~TraceThread() {
+  if(tracer != nullptr) tracer->release(*this);
+}
+
+inline bool tracing() {
+  return tracer().enabled.load(std::memory_order_relaxed);
+}
+
+inline void traceInstant(const char* name, const char* argNames = nullptr, int32_t a = 0, int32_t b = 0) {
+  if(tracing()) tracer().record('i', name, argNames, a, b, 0);
+}
+
+inline void traceCounter(const char* name, float value) {
+  if(tracing()) tracer().record('C', name, nullptr, 0, 0, value);
+}
+
+inline void traceBegin(const char* name, const char* argNames = nullptr, int32_t a = 0, int32_t b = 0) {
+  if(tracing()) tracer().record('B', name, argNames, a, b, 0);
+}
+
+inline void traceEnd(const char* name) {
+  if(tracing()) tracer().record('E', name, nullptr, 0, 0, 0);
+}
+
+// traces the lifetime of a scope as a slice on its thread's timeline
+struct TraceScope {
+  const char* name;
+  bool active;
+
+  TraceScope(const char* n, const char* argNames = nullptr, int32_t a = 0, int32_t b = 0) : name(n) {
+    active = tracing();
+    if(active) tracer().record('B', name, argNames, a, b, 0);
+  }
+
+  ~TraceScope() {
+    if(active) traceEnd(name);
+  }
+};
+
+} // namespace ags
+
+#endif